@@ -0,0 +1,381 @@
+// Microbenchmarks for the server's query path. Builds against server.c directly:
+//
+//   gcc -O2 bench.c -o bench -lm -pthread
+//   ./bench --rows=1000,100000 --label=$(git rev-parse --short HEAD) MSFT.csv TSLA.csv > results.json
+//
+// Every measurement is warmed up first, then timed over a number of samples. Each sample runs the operation
+// enough times to take at least MIN_SAMPLE_NS so the clock resolution doesn't matter. Results go to stdout as
+// JSON (one object per operation and dataset) and a readable summary goes to stderr.
+
+#define SERVER_NO_MAIN
+#include "server.c"
+
+#define DEFAULT_SAMPLES 30
+#define LOADER_SAMPLES 5
+#define MIN_SAMPLE_NS 20000
+#define LOOKUPS 4096
+
+typedef struct
+{
+    Stock* stock;
+    Stock* packed;
+    char* filename;
+    int* lookup_days;
+    char** lookup_dates;
+    double* closes;
+    int size;
+} Dataset;
+
+typedef void (*BenchFunction)(Dataset* data, long iteration);
+
+void bench(char* name, char* dataset, Dataset* data, BenchFunction function, int samples);
+void runDataset(char* label, char* filename);
+bool writeSyntheticCsv(char* path, int rows, unsigned seed);
+uint64_t benchNow();
+int compareDoubles(const void* a, const void* b);
+
+void benchSplit(Dataset* data, long iteration);
+void benchValidDate(Dataset* data, long iteration);
+void benchParseDay(Dataset* data, long iteration);
+void benchGetIndex(Dataset* data, long iteration);
+void benchGetIndexCompact(Dataset* data, long iteration);
+void benchCloseAtPacked(Dataset* data, long iteration);
+void benchReadStockData(Dataset* data, long iteration);
+void benchBuildCalendar(Dataset* data, long iteration);
+void benchPackStock(Dataset* data, long iteration);
+void benchMaxProfit(Dataset* data, long iteration);
+void benchPackedMaxProfit(Dataset* data, long iteration);
+void benchMaxProfitK(Dataset* data, long iteration);
+void benchRoundUp(Dataset* data, long iteration);
+
+// Keeps the compiler from throwing away results nobody looks at
+volatile double bench_sink;
+
+int samples_per_run = DEFAULT_SAMPLES;
+bool first_result = true;
+
+int main(int argc, char** argv)
+{
+    char* label = "";
+    char* rows = "1000,10000,100000,1000000";
+    int files = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--rows=", 7) == 0)
+            rows = argv[i] + 7;
+        else if (strncmp(argv[i], "--samples=", 10) == 0)
+            samples_per_run = atoi(argv[i] + 10) > 0 ? atoi(argv[i] + 10) : DEFAULT_SAMPLES;
+        else if (strncmp(argv[i], "--label=", 8) == 0)
+            label = argv[i] + 8;
+    }
+
+    printf("{\"label\":\"%s\",\"results\":[", label);
+
+    // Real data first, then synthetic files of each requested size
+    for (int i = 1; i < argc; i++)
+    {
+        if (endsWith(argv[i], ".csv"))
+        {
+            runDataset(argv[i], argv[i]);
+            files++;
+        }
+    }
+
+    if (files == 0)
+    {
+        if (access("MSFT.csv", R_OK) == 0)
+            runDataset("MSFT.csv", "MSFT.csv");
+        if (access("TSLA.csv", R_OK) == 0)
+            runDataset("TSLA.csv", "TSLA.csv");
+    }
+
+    char* list = strdup(rows);
+    char* state;
+    for (char* tok = strtok_r(list, ",", &state); tok != NULL; tok = strtok_r(NULL, ",", &state))
+    {
+        int count = atoi(tok);
+        if (count < 2)
+            continue;
+
+        char path[64];
+        char name[64];
+        sprintf(path, "/tmp/bench-%d-%d.csv", (int)getpid(), count);
+        sprintf(name, "synthetic-%d", count);
+
+        if (!writeSyntheticCsv(path, count, 42))
+            continue;
+
+        runDataset(name, path);
+        unlink(path);
+    }
+    free(list);
+
+    printf("\n]}\n");
+
+    return 0;
+}
+
+void runDataset(char* label, char* filename)
+{
+    Dataset data;
+    data.filename = filename;
+    data.stock = read_stock_data(filename);
+
+    if (data.stock == NULL || data.stock -> size < 2)
+    {
+        fprintf(stderr, "Skipping %s, it has fewer than two rows\n", filename);
+        return;
+    }
+
+    buildCalendar(data.stock, false);
+    data.size = data.stock -> size;
+    data.closes = data.stock -> closes;
+
+    // A second copy in the --compress layout
+    data.packed = read_stock_data(filename);
+    buildCalendar(data.packed, true);
+    packStock(data.packed);
+
+    // Half the lookups hit trading days, the other half land anywhere in the calendar
+    srand(7);
+    data.lookup_days = malloc(LOOKUPS * sizeof(int));
+    data.lookup_dates = malloc(LOOKUPS * sizeof(char*));
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        if (i % 2 == 0)
+            data.lookup_days[i] = data.stock -> days[rand() % data.size];
+        else
+            data.lookup_days[i] = data.stock -> days[0] + rand() % data.stock -> calendar -> length;
+
+        data.lookup_dates[i] = malloc(12);
+        formatDay(data.lookup_days[i], data.lookup_dates[i]);
+    }
+
+    fprintf(stderr, "%s (%d rows)\n", label, data.size);
+
+    bench("split", label, &data, benchSplit, samples_per_run);
+    bench("validDate", label, &data, benchValidDate, samples_per_run);
+    bench("parseDay", label, &data, benchParseDay, samples_per_run);
+    bench("getIndex", label, &data, benchGetIndex, samples_per_run);
+    bench("getIndex/compact", label, &data, benchGetIndexCompact, samples_per_run);
+    bench("closeAt/packed", label, &data, benchCloseAtPacked, samples_per_run);
+    bench("roundUp", label, &data, benchRoundUp, samples_per_run);
+    bench("calculateMaxProfit", label, &data, benchMaxProfit, samples_per_run);
+    bench("packedMaxProfit", label, &data, benchPackedMaxProfit, samples_per_run);
+    bench("maxProfitK/k=2", label, &data, benchMaxProfitK, samples_per_run);
+    bench("read_stock_data", label, &data, benchReadStockData, LOADER_SAMPLES);
+    bench("buildCalendar", label, &data, benchBuildCalendar, LOADER_SAMPLES);
+    bench("packStock", label, &data, benchPackStock, LOADER_SAMPLES);
+
+    for (int i = 0; i < LOOKUPS; i++)
+        free(data.lookup_dates[i]);
+    free(data.lookup_dates);
+    free(data.lookup_days);
+}
+
+// Times one operation and prints its statistics in nanoseconds per call
+void bench(char* name, char* dataset, Dataset* data, BenchFunction function, int samples)
+{
+    // Warm up caches and branch predictors, and find out how many calls make up one sample
+    long iterations = 1;
+    long next = 0;
+    while (1)
+    {
+        uint64_t start = benchNow();
+        for (long i = 0; i < iterations; i++)
+            function(data, next++);
+        uint64_t elapsed = benchNow() - start;
+
+        if (elapsed >= MIN_SAMPLE_NS || iterations >= (1L << 30))
+            break;
+
+        iterations *= 2;
+    }
+
+    double* results = malloc(samples * sizeof(double));
+    double total = 0;
+
+    for (int s = 0; s < samples; s++)
+    {
+        uint64_t start = benchNow();
+        for (long i = 0; i < iterations; i++)
+            function(data, next++);
+
+        results[s] = (double)(benchNow() - start) / iterations;
+        total += results[s];
+    }
+
+    qsort(results, samples, sizeof(double), compareDoubles);
+
+    double mean = total / samples;
+    double variance = 0;
+    for (int s = 0; s < samples; s++)
+        variance += (results[s] - mean) * (results[s] - mean);
+
+    double stddev = samples > 1 ? sqrt(variance / (samples - 1)) : 0;
+    double median = results[samples / 2];
+    double p90 = results[(int)(samples * 0.9) < samples ? (int)(samples * 0.9) : samples - 1];
+
+    fprintf(stderr, "  %-20s %14.1f ns/op (min %.1f, stddev %.1f)\n", name, median, results[0], stddev);
+
+    printf("%s\n{\"name\":\"%s\",\"dataset\":\"%s\",\"rows\":%d,\"samples\":%d,\"iterations\":%ld,"
+        "\"min_ns\":%.2f,\"median_ns\":%.2f,\"mean_ns\":%.2f,\"p90_ns\":%.2f,\"max_ns\":%.2f,\"stddev_ns\":%.2f}",
+        first_result ? "" : ",", name, dataset, data->size, samples, iterations,
+        results[0], median, mean, p90, results[samples - 1], stddev);
+    first_result = false;
+
+    free(results);
+}
+
+// Consecutive calendar days starting in 1800 with a random walk close, in the same layout as the bundled files.
+// parseDay() stops at the year 9999, which caps a daily series at about three million rows.
+bool writeSyntheticCsv(char* path, int rows, unsigned seed)
+{
+    int first_day = parseDay("1800-01-01");
+    int last_day = parseDay("9999-12-31");
+
+    if (rows > last_day - first_day + 1)
+    {
+        fprintf(stderr, "Skipping %d synthetic rows, daily dates only cover %d\n", rows, last_day - first_day + 1);
+        return false;
+    }
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror("Error: Unable to write synthetic data");
+        return false;
+    }
+
+    fprintf(file, "Date,Open,High,Low,Close,Adj Close,Volume\n");
+
+    srand(seed);
+    double close = 100;
+    char date[12];
+
+    for (int i = 0; i < rows; i++)
+    {
+        double open = close;
+        close *= 1 + ((double)rand() / RAND_MAX - 0.5) * 0.04;
+        if (close < 1)
+            close = 1;
+
+        formatDay(first_day + i, date);
+        fprintf(file, "%s,%.4f,%.4f,%.4f,%.4f,%.4f,%d\n", date, open, fmax(open, close) * 1.01,
+            fmin(open, close) * 0.99, close, close, 1000000 + rand() % 1000000);
+    }
+
+    fclose(file);
+    return true;
+}
+
+uint64_t benchNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void benchSplit(Dataset* data, long iteration)
+{
+    char request[] = "MaxProfit TSLA 2021-11-04 2022-01-10";
+    char** args = split(request);
+
+    for (int i = 0; args[i] != NULL; i++)
+        free(args[i]);
+    free(args);
+}
+
+void benchValidDate(Dataset* data, long iteration)
+{
+    bench_sink = validDate(data->lookup_dates[iteration % LOOKUPS]);
+}
+
+void benchParseDay(Dataset* data, long iteration)
+{
+    bench_sink = parseDay(data->lookup_dates[iteration % LOOKUPS]);
+}
+
+void benchGetIndex(Dataset* data, long iteration)
+{
+    bench_sink = getIndex(data->stock, data->lookup_days[iteration % LOOKUPS]);
+}
+
+void benchGetIndexCompact(Dataset* data, long iteration)
+{
+    bench_sink = getIndex(data->packed, data->lookup_days[iteration % LOOKUPS]);
+}
+
+void benchCloseAtPacked(Dataset* data, long iteration)
+{
+    bench_sink = closeAt(data->packed, (int)(iteration * 7919 % data->size));
+}
+
+void benchRoundUp(Dataset* data, long iteration)
+{
+    char* rounded = roundUp("258.4208355058379");
+    bench_sink = rounded[0];
+    free(rounded);
+}
+
+void benchMaxProfit(Dataset* data, long iteration)
+{
+    bench_sink = calculateMaxProfit(data->closes, data->size);
+}
+
+void benchPackedMaxProfit(Dataset* data, long iteration)
+{
+    bench_sink = packedMaxProfit(data->packed, 0, data->size - 1);
+}
+
+void benchMaxProfitK(Dataset* data, long iteration)
+{
+    bench_sink = maxProfitK(data->closes, data->size, 2, 0, 0);
+}
+
+void benchReadStockData(Dataset* data, long iteration)
+{
+    Stock* stock = read_stock_data(data->filename);
+
+    bench_sink = stock -> size;
+    free(stock -> days);
+    free(stock -> closes);
+    free(stock -> name);
+    free(stock);
+}
+
+void benchBuildCalendar(Dataset* data, long iteration)
+{
+    Calendar* previous = data->stock -> calendar;
+    buildCalendar(data->stock, false);
+
+    bench_sink = data->stock -> calendar -> length;
+    free(data->stock -> calendar -> rows);
+    free(data->stock -> calendar);
+    data->stock -> calendar = previous;
+}
+
+void benchPackStock(Dataset* data, long iteration)
+{
+    // packStock() consumes the plain columns, so give it a copy
+    Stock copy = *data->stock;
+    copy.days = malloc(data->size * sizeof(int));
+    copy.closes = malloc(data->size * sizeof(double));
+    memcpy(copy.days, data->stock -> days, data->size * sizeof(int));
+    memcpy(copy.closes, data->stock -> closes, data->size * sizeof(double));
+
+    packStock(&copy);
+
+    bench_sink = copy.packed -> byte_count;
+    free(copy.packed -> blocks);
+    free(copy.packed -> bytes);
+    free(copy.packed);
+}
@@ -9,6 +9,39 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/un.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// How requests reach the server. The unix socket and shared memory ones only work on the same host.
+typedef enum
+{
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM
+} Transport;
+
+// Must match the layout in server.c
+#define SHM_SLOTS 16
+#define SHM_SLOT_SIZE 1024
+
+typedef struct
+{
+    _Alignas(64) uint32_t head;
+    _Alignas(64) uint32_t tail;
+    _Alignas(64) char slots[SHM_SLOTS][SHM_SLOT_SIZE];
+} ShmRing;
+
+typedef struct
+{
+    ShmRing requests;
+    ShmRing responses;
+} ShmChannel;
 
 void loop(char* server_address, int server_listening_port);
 char* readString();
@@ -16,9 +49,22 @@ char* getEmptyString();
 void checkValidPtr(char* ptr);
 char** split(char* inputStr);
 char* send_to_server(char* server_address, int server_listening_port, char* text);
+int open_connection(char* server_address, int server_listening_port);
+void follow_subscription(char* server_address, int server_listening_port, char* text);
+int connect_unix(char* path);
+void attach_shm(char* path);
+char* send_over_shm(char* text);
 bool validDate(char* date);
 bool dateIsBeforeOrOn(char* date1, char* date2);
+bool validAppend(char** args);
 
+Transport transport = TRANSPORT_TCP;
+
+// Only used by the shared memory transport
+ShmChannel* shm_channel = NULL;
+int shm_connection = -1;
+int shm_request_event = -1;
+int shm_response_event = -1;
 
 int main(int argc, char** argv)
 {
@@ -29,7 +75,16 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    loop(argv[1], atoi(argv[2]));
+    // Alternatively "--unix /tmp/stocks.sock" or "--shm /tmp/stocks-shm.sock" for a server on the same machine
+    if (strcmp(argv[1], "--unix") == 0)
+        transport = TRANSPORT_UNIX;
+    else if (strcmp(argv[1], "--shm") == 0)
+    {
+        transport = TRANSPORT_SHM;
+        attach_shm(argv[2]);
+    }
+
+    loop(argv[1 + (transport != TRANSPORT_TCP)], atoi(argv[2]));
 }
 
 void loop(char* server_address, int server_listening_port)
@@ -49,7 +104,11 @@ void loop(char* server_address, int server_listening_port)
             continue;
         }
         else if ((strcmp(args[0], "quit") == 0) || (strcmp(args[0], "List") == 0) || (strcmp(args[0], "Prices") == 0 && args[1] != NULL && args[2] != NULL && validDate(args[2])) 
-            || (strcmp(args[0], "MaxProfit") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL && validDate(args[2]) && validDate(args[3]) && dateIsBeforeOrOn(args[2], args[3])))
+            || (strcmp(args[0], "MaxProfit") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL && validDate(args[2]) && validDate(args[3]) && dateIsBeforeOrOn(args[2], args[3]))
+            || (strcmp(args[0], "MaxProfitK") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL && args[4] != NULL && validDate(args[2]) && validDate(args[3]) && dateIsBeforeOrOn(args[2], args[3]) && atoi(args[4]) > 0)
+            || ((strcmp(args[0], "Volatility") == 0 || strcmp(args[0], "MaxDrawdown") == 0) && args[1] != NULL && args[2] != NULL && args[3] != NULL && validDate(args[2]) && validDate(args[3]) && dateIsBeforeOrOn(args[2], args[3]))
+            || (strcmp(args[0], "Correlation") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL && args[4] != NULL && validDate(args[3]) && validDate(args[4]) && dateIsBeforeOrOn(args[3], args[4]))
+            || (strcmp(args[0], "Append") == 0 && validAppend(args)))
         {
             server_response = send_to_server(server_address, server_listening_port, input);
 
@@ -59,6 +118,10 @@ void loop(char* server_address, int server_listening_port)
             // Print the server response to the client
             printf("%s\n", server_response);
         }
+        else if (strcmp(args[0], "Subscribe") == 0 && args[1] != NULL && transport != TRANSPORT_SHM)
+            follow_subscription(server_address, server_listening_port, input);
+        else if (strcmp(args[0], "Subscribe") == 0)
+            printf("Subscribe needs a TCP or --unix connection\n");
         else 
             printf("Invalid syntax\n");
 
@@ -164,35 +227,13 @@ char* send_to_server(char* server_address, int server_listening_port, char* text
         return response;
     }
 
-    // Creates a socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) 
-    {
-        perror("Error: Unable to create socket");
-        exit(1);
-    }
-
-    // Sets up the server address
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(server_listening_port);
-
-    // Converts the server address from a domain name to an IP address (If it has to)
-    struct hostent* server = gethostbyname(server_address);
-    if (server == NULL)
+    if (transport == TRANSPORT_SHM)
     {
-        perror("Error: No such host");
-        exit(1);
+        free(response);
+        return send_over_shm(text);
     }
-    memcpy(&serv_addr.sin_addr, server->h_addr, server->h_length);
 
-    // Connects to the server
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) 
-    {
-        perror("Error: Connection failed");
-        exit(1);
-    }
+    int sock = open_connection(server_address, server_listening_port);
 
     // Sends the message
     if (send(sock, text, strlen(text), 0) < 0) 
@@ -201,12 +242,19 @@ char* send_to_server(char* server_address, int server_listening_port, char* text
         exit(1);
     }
 
-    // Receives the message
+    // Receives the message, growing the buffer as needed (List can run to many kilobytes)
+    int capacity = 1024;
     int total_len = 0;
     int len;
     do 
     {
-        len = recv(sock, response + total_len, 1024 - total_len, 0);
+        if (capacity - total_len < 512)
+        {
+            capacity *= 2;
+            response = realloc(response, capacity);
+        }
+
+        len = recv(sock, response + total_len, capacity - total_len - 1, 0);
         if (len < 0) 
         {
             perror("Error: Receive failed");
@@ -225,6 +273,188 @@ char* send_to_server(char* server_address, int server_listening_port, char* text
     return response;
 }
 
+int open_connection(char* server_address, int server_listening_port)
+{
+    int sock;
+
+    // For the unix socket transport server_address is the socket's path
+    if (transport == TRANSPORT_UNIX)
+        sock = connect_unix(server_address);
+    else
+    {
+        // Creates a socket
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == -1) 
+        {
+            perror("Error: Unable to create socket");
+            exit(1);
+        }
+
+        // Sets up the server address
+        struct sockaddr_in serv_addr;
+        memset(&serv_addr, 0, sizeof(serv_addr));
+        serv_addr.sin_family = AF_INET;
+        serv_addr.sin_port = htons(server_listening_port);
+
+        // Converts the server address from a domain name to an IP address (If it has to)
+        struct hostent* server = gethostbyname(server_address);
+        if (server == NULL)
+        {
+            perror("Error: No such host");
+            exit(1);
+        }
+        memcpy(&serv_addr.sin_addr, server->h_addr, server->h_length);
+
+        // Connects to the server
+        if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) 
+        {
+            perror("Error: Connection failed");
+            exit(1);
+        }
+    }
+
+    return sock;
+}
+
+// Prints what the server pushes for a Subscribe until the server goes away (or the user hits Ctrl-C)
+void follow_subscription(char* server_address, int server_listening_port, char* text)
+{
+    int sock = open_connection(server_address, server_listening_port);
+
+    if (send(sock, text, strlen(text), 0) < 0) 
+    {
+        perror("Error: Send failed");
+        exit(1);
+    }
+
+    char buffer[4096];
+    int len;
+    while ((len = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+    {
+        fwrite(buffer, 1, len, stdout);
+        fflush(stdout);
+    }
+
+    printf("\n");
+    close(sock);
+}
+
+int connect_unix(char* path)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+    {
+        perror("Error: Unable to create socket");
+        exit(1);
+    }
+
+    struct sockaddr_un serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    strncpy(serv_addr.sun_path, path, sizeof(serv_addr.sun_path) - 1);
+
+    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        perror("Error: Connection failed");
+        exit(1);
+    }
+
+    return sock;
+}
+
+// Picks up the memfd holding our request/response rings and the two eventfds used to wake each side
+void attach_shm(char* path)
+{
+#ifdef __linux__
+    shm_connection = connect_unix(path);
+
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    char ok[3] = "";
+    struct iovec data = { ok, 2 };
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr* header;
+    if (recvmsg(shm_connection, &message, 0) <= 0 || (header = CMSG_FIRSTHDR(&message)) == NULL || header->cmsg_type != SCM_RIGHTS)
+    {
+        perror("Error: Server did not hand over shared memory");
+        exit(1);
+    }
+    memcpy(fds, CMSG_DATA(header), sizeof(fds));
+
+    shm_channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shm_channel == MAP_FAILED)
+    {
+        perror("Error: Unable to map shared memory");
+        exit(1);
+    }
+
+    close(fds[0]);
+    shm_request_event = fds[1];
+    shm_response_event = fds[2];
+#else
+    printf("Error: The shared memory transport is only available on Linux\n");
+    exit(1);
+#endif
+}
+
+char* send_over_shm(char* text)
+{
+    char* response = malloc(SHM_SLOT_SIZE * sizeof(char));
+    ShmRing* requests = &shm_channel->requests;
+    ShmRing* responses = &shm_channel->responses;
+
+    // We only ever have one request in flight, so there is always room
+    uint32_t tail = requests->tail;
+    strncpy(requests->slots[tail % SHM_SLOTS], text, SHM_SLOT_SIZE - 1);
+    requests->slots[tail % SHM_SLOTS][SHM_SLOT_SIZE - 1] = '\0';
+    __atomic_store_n(&requests->tail, tail + 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    if (write(shm_request_event, &one, sizeof(one)) < 0)
+    {
+        perror("Error: Send failed");
+        exit(1);
+    }
+
+    // Answers usually come back within a few microseconds, so spin for a little before going to sleep
+    uint32_t head = responses->head;
+    int spins = 0;
+    while (head == __atomic_load_n(&responses->tail, __ATOMIC_ACQUIRE))
+    {
+        if (++spins < 20000)
+            continue;
+
+        // Watch the connection too, the server hangs up without answering when it quits
+        struct pollfd waiting[2] = { { shm_response_event, POLLIN, 0 }, { shm_connection, POLLIN, 0 } };
+        if (poll(waiting, 2, -1) < 0 && errno != EINTR)
+        {
+            perror("Error: Receive failed");
+            exit(1);
+        }
+
+        uint64_t wakeups;
+        if (waiting[0].revents & POLLIN)
+            read(shm_response_event, &wakeups, sizeof(wakeups));
+        else if (waiting[1].revents)
+        {
+            response[0] = '\0';
+            return response;
+        }
+    }
+
+    strcpy(response, responses->slots[head % SHM_SLOTS]);
+    __atomic_store_n(&responses->head, head + 1, __ATOMIC_RELEASE);
+
+    return response;
+}
+
 bool validDate(char* date) 
 {
     int year, month, day;
@@ -297,3 +527,18 @@ bool dateIsBeforeOrOn(char* date1, char* date2)
     return false;
 }
 
+// Append TICKER followed by one or more bars of date open high low close adjclose volume
+bool validAppend(char** args)
+{
+    if (args[1] == NULL || args[2] == NULL)
+        return false;
+
+    int fields = 0;
+    for (int i = 2; args[i] != NULL; i++, fields++)
+    {
+        if (fields % 7 == 0 && !validDate(args[i]))
+            return false;
+    }
+
+    return fields % 7 == 0;
+}
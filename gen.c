@@ -0,0 +1,434 @@
+// Writes synthetic price histories in the same CSV layout as MSFT.csv and TSLA.csv, for testing at scale:
+//
+//   gcc -O2 gen.c -o gen -lm -pthread
+//   ./gen --tickers=5000 --rows=2520 --seed=1 --dir=data
+//   ./server data/*.csv 8080
+//
+// Every ticker trades on the same NYSE style calendar (no weekends or exchange holidays) and follows a random
+// walk with its own volatility and drift. Each ticker's numbers only depend on the seed and the ticker's
+// position, so the output is the same no matter how many threads write it.
+
+#define SERVER_NO_MAIN
+#include "server.c"
+
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#define WRITE_BUFFER_SIZE (1 << 16)
+
+typedef struct
+{
+    int tickers;
+    int rows;
+    uint64_t seed;
+    char* dir;
+    int* days;
+    _Atomic int next;
+    _Atomic long written;
+} Generator;
+
+typedef struct
+{
+    int fd;
+    char* data;
+    int used;
+    long total;
+} WriteBuffer;
+
+int* tradingDays(char* start, int rows);
+bool isTradingDay(int day);
+bool isHoliday(int year, int month, int dayOfMonth, int weekday);
+int easterDay(int year);
+void tickerName(int index, int tickers, char* out);
+void* generateFiles(void* arg);
+void generateTicker(Generator* gen, int index);
+uint64_t nextRandom(uint64_t* state);
+double uniformRandom(uint64_t* state);
+double normalRandom(uint64_t* state);
+void bufferPrice(WriteBuffer* buffer, double price);
+void bufferInt(WriteBuffer* buffer, long value);
+void bufferText(WriteBuffer* buffer, const char* text, int length);
+void flushBuffer(WriteBuffer* buffer);
+
+int main(int argc, char** argv)
+{
+    Generator gen;
+    gen.tickers = 100;
+    gen.rows = 2520;
+    gen.seed = 1;
+    gen.dir = "data";
+    atomic_init(&gen.next, 0);
+    atomic_init(&gen.written, 0);
+
+    char* start = "2000-01-03";
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--tickers=", 10) == 0)
+            gen.tickers = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--rows=", 7) == 0)
+            gen.rows = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+            gen.seed = strtoull(argv[i] + 7, NULL, 10);
+        else if (strncmp(argv[i], "--start=", 8) == 0)
+            start = argv[i] + 8;
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--dir=", 6) == 0)
+            gen.dir = argv[i] + 6;
+        else
+        {
+            fprintf(stderr, "Usage: %s [--tickers=N] [--rows=N] [--seed=N] [--start=YYYY-MM-DD] [--threads=N] [--dir=PATH]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (gen.tickers < 1 || gen.rows < 1 || parseDay(start) == -1)
+    {
+        fprintf(stderr, "Error: Need at least one ticker, one row and a valid start date\n");
+        exit(1);
+    }
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > gen.tickers)
+        threads = gen.tickers;
+
+    gen.days = tradingDays(start, gen.rows);
+
+    if (mkdir(gen.dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror("Error: Unable to create output directory");
+        exit(1);
+    }
+
+    struct timespec began, ended;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    for (int t = 0; t < threads; t++)
+    {
+        if (pthread_create(&workers[t], NULL, generateFiles, &gen) != 0)
+        {
+            perror("Error: Unable to start writer thread");
+            exit(1);
+        }
+    }
+
+    for (int t = 0; t < threads; t++)
+        pthread_join(workers[t], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    double seconds = (ended.tv_sec - began.tv_sec) + (ended.tv_nsec - began.tv_nsec) / 1e9;
+
+    char first[12], last[12];
+    formatDay(gen.days[0], first);
+    formatDay(gen.days[gen.rows - 1], last);
+
+    printf("Wrote %d files with %d rows each (%s to %s) to %s/, %.1f MB in %.2fs\n", gen.tickers, gen.rows, first,
+        last, gen.dir, atomic_load(&gen.written) / 1e6, seconds);
+
+    free(workers);
+    free(gen.days);
+
+    return 0;
+}
+
+// The first rows trading days on or after start
+int* tradingDays(char* start, int rows)
+{
+    int* days = malloc(rows * sizeof(int));
+    int day = parseDay(start);
+    int last = parseDay("9999-12-31");
+
+    for (int row = 0; row < rows; day++)
+    {
+        if (day > last)
+        {
+            fprintf(stderr, "Error: %d trading days from %s run past the year 9999\n", rows, start);
+            exit(1);
+        }
+
+        if (isTradingDay(day))
+            days[row++] = day;
+    }
+
+    return days;
+}
+
+bool isTradingDay(int day)
+{
+    // Day 0 (0000-03-01) was a Wednesday, this counts Sunday as 0
+    int weekday = (day + 3) % 7;
+
+    if (weekday == 0 || weekday == 6)
+        return false;
+
+    char date[12];
+    int year, month, dayOfMonth;
+
+    formatDay(day, date);
+    sscanf(date, "%d-%d-%d", &year, &month, &dayOfMonth);
+
+    if (isHoliday(year, month, dayOfMonth, weekday))
+        return false;
+
+    // Good Friday moves with Easter so it can't be checked from the date alone
+    return day != easterDay(year) - 2;
+}
+
+// The fixed and floating NYSE holidays. A fixed holiday on a Saturday is taken on the Friday before and one on
+// a Sunday on the Monday after, except New Year's Day which is simply lost when it falls on a Saturday.
+bool isHoliday(int year, int month, int dayOfMonth, int weekday)
+{
+    int fixed[][2] = {{1, 1}, {6, 19}, {7, 4}, {12, 25}};
+    int week = (dayOfMonth - 1) / 7;
+
+    for (int i = 0; i < 4; i++)
+    {
+        // Juneteenth has only been a market holiday since 2022
+        if (fixed[i][0] == 6 && year < 2022)
+            continue;
+
+        if (month == fixed[i][0] && dayOfMonth == fixed[i][1])
+            return true;
+        if (weekday == 1 && month == fixed[i][0] && dayOfMonth == fixed[i][1] + 1)
+            return true;
+        if (weekday == 5 && month == fixed[i][0] && dayOfMonth == fixed[i][1] - 1)
+            return true;
+    }
+
+    // Martin Luther King Jr. Day, Presidents' Day, Memorial Day, Labor Day and Thanksgiving
+    if (month == 1 && weekday == 1 && week == 2 && year >= 1998)
+        return true;
+    if (month == 2 && weekday == 1 && week == 2)
+        return true;
+    if (month == 5 && weekday == 1 && dayOfMonth + 7 > 31)
+        return true;
+    if (month == 9 && weekday == 1 && week == 0)
+        return true;
+    if (month == 11 && weekday == 4 && week == 3)
+        return true;
+
+    return false;
+}
+
+// Easter Sunday from the anonymous Gregorian algorithm (Meeus/Jones/Butcher)
+int easterDay(int year)
+{
+    int a = year % 19;
+    int b = year / 100;
+    int c = year % 100;
+    int g = (b - (b + 8) / 25 + 1) / 3;
+    int h = (19 * a + b - b / 4 - g + 15) % 30;
+    int l = (32 + 2 * (b % 4) + 2 * (c / 4) - h - c % 4) % 7;
+    int m = (a + 11 * h + 22 * l) / 451;
+    int f = h + l - 7 * m + 114;
+
+    char date[12];
+    sprintf(date, "%04d-%02d-%02d", year, f / 31, f % 31 + 1);
+
+    return parseDay(date);
+}
+
+// AAA, AAB, ... with enough letters that every ticker gets a name of the same length
+void tickerName(int index, int tickers, char* out)
+{
+    int length = 3;
+    for (long capacity = 26 * 26 * 26; capacity < tickers; capacity *= 26)
+        length++;
+
+    for (int i = length - 1; i >= 0; i--)
+    {
+        out[i] = 'A' + index % 26;
+        index /= 26;
+    }
+
+    out[length] = '\0';
+}
+
+// Each thread keeps taking the next unwritten ticker until there are none left
+void* generateFiles(void* arg)
+{
+    Generator* gen = arg;
+
+    while (1)
+    {
+        int index = atomic_fetch_add(&gen->next, 1);
+        if (index >= gen->tickers)
+            break;
+
+        generateTicker(gen, index);
+    }
+
+    return NULL;
+}
+
+void generateTicker(Generator* gen, int index)
+{
+    char name[16];
+    char path[PATH_MAX];
+
+    tickerName(index, gen->tickers, name);
+    snprintf(path, sizeof(path), "%s/%s.csv", gen->dir, name);
+
+    WriteBuffer buffer;
+    buffer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    buffer.data = malloc(WRITE_BUFFER_SIZE);
+    buffer.used = 0;
+    buffer.total = 0;
+
+    if (buffer.fd < 0)
+    {
+        perror("Error: Unable to write stock file");
+        exit(1);
+    }
+
+    // A stream of its own for every ticker so the thread count doesn't change the output
+    uint64_t state = gen->seed * 0x9e3779b97f4a7c15ULL + (uint64_t)index;
+    nextRandom(&state);
+
+    double price = exp(log(5) + uniformRandom(&state) * log(100));
+    double volatility = (0.15 + uniformRandom(&state) * 0.45) / sqrt(TRADING_DAYS_PER_YEAR);
+    double drift = (-0.05 + uniformRandom(&state) * 0.2) / TRADING_DAYS_PER_YEAR;
+    double dividendYield = uniformRandom(&state) * 0.03 / TRADING_DAYS_PER_YEAR;
+    double baseVolume = exp(log(1e5) + uniformRandom(&state) * log(1e3));
+
+    char header[] = "Date,Open,High,Low,Close,Adj Close,Volume\n";
+    bufferText(&buffer, header, sizeof(header) - 1);
+
+    char date[12];
+    for (int row = 0; row < gen->rows; row++)
+    {
+        double open = price * exp(normalRandom(&state) * volatility * 0.2);
+        double move = normalRandom(&state);
+        double close = open * exp(drift - volatility * volatility / 2 + move * volatility);
+
+        // Very long walks can drift towards zero, keep them quoting at least a cent
+        if (close < 0.01)
+            close = 0.01;
+        if (open < 0.01)
+            open = 0.01;
+
+        double high = fmax(open, close) * exp(fabs(normalRandom(&state)) * volatility * 0.5);
+        double low = fmin(open, close) * exp(-fabs(normalRandom(&state)) * volatility * 0.5);
+
+        // Adjusted closes are scaled down by the dividends paid out since
+        double adjusted = close * exp(-dividendYield * (gen->rows - 1 - row));
+        long volume = (long)(baseVolume * (1 + fabs(move)) * exp(normalRandom(&state) * 0.3));
+
+        formatDay(gen->days[row], date);
+        bufferText(&buffer, date, 10);
+        bufferText(&buffer, ",", 1);
+        bufferPrice(&buffer, open);
+        bufferPrice(&buffer, high);
+        bufferPrice(&buffer, low);
+        bufferPrice(&buffer, close);
+        bufferPrice(&buffer, adjusted);
+        bufferInt(&buffer, volume);
+        bufferText(&buffer, "\n", 1);
+
+        price = close;
+    }
+
+    flushBuffer(&buffer);
+    atomic_fetch_add(&gen->written, buffer.total);
+    close(buffer.fd);
+    free(buffer.data);
+}
+
+// splitmix64
+uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+// In (0, 1) so it is always safe to take the log of
+double uniformRandom(uint64_t* state)
+{
+    return ((nextRandom(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+// Box-Muller, throwing away the second value to keep the stream simple
+double normalRandom(uint64_t* state)
+{
+    double u = uniformRandom(state);
+    double v = uniformRandom(state);
+
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// Prices go out with four decimals followed by a comma, printf is most of the run time otherwise
+void bufferPrice(WriteBuffer* buffer, double price)
+{
+    long scaled = lround(price * 10000);
+    char text[32];
+    int length = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        text[sizeof(text) - 1 - length++] = '0' + scaled % 10;
+        scaled /= 10;
+    }
+    text[sizeof(text) - 1 - length++] = '.';
+
+    do
+    {
+        text[sizeof(text) - 1 - length++] = '0' + scaled % 10;
+        scaled /= 10;
+    } while (scaled > 0);
+
+    bufferText(buffer, text + sizeof(text) - length, length);
+    bufferText(buffer, ",", 1);
+}
+
+void bufferInt(WriteBuffer* buffer, long value)
+{
+    char text[24];
+    int length = 0;
+
+    do
+    {
+        text[sizeof(text) - 1 - length++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    bufferText(buffer, text + sizeof(text) - length, length);
+}
+
+void bufferText(WriteBuffer* buffer, const char* text, int length)
+{
+    if (buffer->used + length > WRITE_BUFFER_SIZE)
+        flushBuffer(buffer);
+
+    memcpy(buffer->data + buffer->used, text, length);
+    buffer->used += length;
+}
+
+void flushBuffer(WriteBuffer* buffer)
+{
+    int done = 0;
+
+    while (done < buffer->used)
+    {
+        ssize_t written = write(buffer->fd, buffer->data + done, buffer->used - done);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("Error: Unable to write stock file");
+            exit(1);
+        }
+
+        done += written;
+    }
+
+    buffer->total += buffer->used;
+    buffer->used = 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -9,13 +11,112 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/un.h>
 #include <math.h>
-
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+
+// Stage tracing is compiled in with -DTRACE. Spans close themselves at the end of their scope (or at TRACE_END),
+// go into a ring buffer per thread and are written out as Chrome trace JSON when the server exits.
+#ifdef TRACE
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(probe, name) DTRACE_PROBE1(stock_server, probe, name)
+#endif
+#endif
+
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(probe, name)
+#endif
+
+typedef struct
+{
+    const char* name;
+    uint64_t start;
+    bool open;
+} TraceSpan;
+
+TraceSpan traceBegin(const char* name);
+void traceEnd(TraceSpan* span);
+void traceRequest();
+void traceFlush();
+
+#define TRACE_SPAN(span, name) TraceSpan span __attribute__((cleanup(traceEnd))) = traceBegin(name)
+#define TRACE_END(span) traceEnd(&span)
+#define TRACE_REQUEST() traceRequest()
+#else
+#define TRACE_SPAN(span, name)
+#define TRACE_END(span)
+#define TRACE_REQUEST()
+#endif
+
+// Rows per compressed block, and the fixed point scale closing prices are stored at (four decimal places)
+#define PACK_BLOCK_ROWS 128
+#define PACK_PRICE_SCALE 10000
+
+// Summary of one compressed block so queries can skip it, or find the one they need, without decoding
+typedef struct
+{
+    int first_day;
+    int last_day;
+    int64_t min_price;
+    int64_t max_price;
+    uint32_t offset;
+    int count;
+} PackedBlock;
+
+// Delta-of-delta encoded days and delta encoded fixed point closes, interleaved per row as zigzag varints
+typedef struct
+{
+    PackedBlock* blocks;
+    int block_count;
+    unsigned char* bytes;
+    size_t byte_count;
+    int rows;
+} PackedColumn;
+
+// Maps every calendar day from the first trading day to the last onto its row. Normally that is a plain array
+// with -1 for days without trading, with --compress it is a bitset of trading days plus the running count of
+// trading days before each 64 day word, so a row is a rank query. Capacity is how many days fit before the
+// arrays have to grow for an Append.
+typedef struct
+{
+    int first_day;
+    int length;
+    int capacity;
+    int* rows;
+    uint64_t* bits;
+    uint32_t* ranks;
+} Calendar;
+
+// Trading days are stored as day numbers (see parseDay) next to their closing price. With --compress the
+// plain columns are dropped and only the packed copy is kept, after which days and closes only hold the rows
+// added by Append (row packed->rows onwards).
 typedef struct 
 {
     char* name;
-    char** dates;
-    char** prices;
+    int size;
+    int capacity;
+    int* days;
+    double* closes;
+    PackedColumn* packed;
+    Calendar* calendar;
 } Stock;
 
 typedef struct 
@@ -24,27 +125,296 @@ typedef struct
     int size;
 } StockList;
 
+// The analytics kernels work on VECTOR_LANES doubles at a time through GCC vector extensions, which become pairs of
+// SSE2 (or plain scalar) instructions on targets without AVX. Columns they load from are VECTOR_BYTES aligned.
+#define VECTOR_BYTES 32
+#define VECTOR_LANES (int)(VECTOR_BYTES / sizeof(double))
+#define TRADING_DAYS_PER_YEAR 252
+
+typedef double DoubleVector __attribute__((vector_size(VECTOR_BYTES)));
+
+// Startup loading. Files bigger than LOAD_CHUNK_BYTES are cut into chunks at line boundaries so a single big file
+// is parsed on several threads too, each chunk keeps its rows until the file is joined back together.
+#define LOAD_CHUNK_BYTES (4 << 20)
+
+typedef struct
+{
+    char* filename;
+    off_t start;
+    off_t end;
+    int* days;
+    double* closes;
+    int count;
+    int skipped;
+    bool opened;
+    double seconds;
+} LoadChunk;
+
+typedef enum
+{
+    LOAD_PARSE,
+    LOAD_FINISH
+} LoadPhase;
+
+// File i owns chunks first_chunk[i] up to first_chunk[i + 1]. Threads take the next chunk (or file) from next.
+typedef struct
+{
+    char** files;
+    int file_count;
+    LoadChunk* chunks;
+    int* first_chunk;
+    Stock** loaded;
+    bool compress;
+    int threads;
+    LoadPhase phase;
+    int tasks;
+    int next;
+    int finished;
+} LoadJob;
+
+// Shared memory transport: each client gets a request ring and a response ring in a memfd of its own. Answers
+// longer than a slot are truncated, use a socket for List on big data sets.
+#define SHM_SLOTS 16
+#define SHM_SLOT_SIZE 1024
+#define SHM_ACCEPT_BACKOFF_NS 100000000
+#define SHM_FULL_WAIT_MS 10
+
+// Single producer, single consumer. head and tail live on their own cache lines so the two sides don't fight.
+typedef struct
+{
+    _Alignas(64) uint32_t head;
+    _Alignas(64) uint32_t tail;
+    _Alignas(64) char slots[SHM_SLOTS][SHM_SLOT_SIZE];
+} ShmRing;
+
+typedef struct
+{
+    ShmRing requests;
+    ShmRing responses;
+} ShmChannel;
+
+typedef struct
+{
+    int connection;
+    int request_event;
+    int response_event;
+    ShmChannel* channel;
+    StockList* stocks;
+    bool trusted;
+} ShmSession;
+
+// Which I/O loop the server uses to accept clients and answer their requests
+typedef enum
+{
+    BACKEND_BLOCKING,
+    BACKEND_EPOLL,
+    BACKEND_URING
+} Backend;
+
+// One ticker a subscriber follows. Rows before next_row have been folded into the running minimum and best
+// profit, the ones from next_row on haven't been sent yet.
+typedef struct
+{
+    Stock* stock;
+    int next_row;
+    double min_close;
+    double max_profit;
+} Subscription;
+
+// Pushed lines wait in buffer until the socket takes them. The buffer is all the queue there is, a subscriber that
+// can't keep up skips straight to the latest bar instead of making anyone else wait.
+#define SUBSCRIBER_BUFFER 4096
+#define SUBSCRIBER_BACKLOG 64
+#define SUBSCRIBER_SOCKET_BUFFER 65536
+
+typedef struct Subscriber
+{
+    int fd;
+    Subscription* subscriptions;
+    int subscription_count;
+    char buffer[SUBSCRIBER_BUFFER];
+    int buffered;
+    struct Subscriber* next;
+} Subscriber;
+
+// Request logging. Serving threads only copy a fixed size record into a ring of their own and a background thread
+// formats and writes them out, so a slow log (stdout piped into a collector, say) never holds up a request. When
+// a ring is full the record is dropped and counted instead.
+#define LOG_RING_SIZE 1024
+#define LOG_TEXT_SIZE 232
+#define LOG_IDLE_SLEEP_NS 2000000
+
+typedef enum
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} LogLevel;
+
+typedef struct
+{
+    uint64_t time;
+    int level;
+    int length;
+    char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+// The owning thread moves head and dropped, the log thread moves tail. retired is set once the owner has exited.
+typedef struct LogRing
+{
+    _Alignas(64) uint64_t head;
+    _Alignas(64) uint64_t tail;
+    _Alignas(64) uint64_t dropped;
+    uint64_t reported;
+    int thread_id;
+    bool retired;
+    struct LogRing* next;
+    LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
 void listenAndRespond(int client_socket, StockList* stocks);
 char* processRequest(char* client_command, StockList* stocks);
 char** split(char* inputStr);
 Stock* read_stock_data(char* filename);
+void loadChunk(LoadChunk* chunk);
+bool parseStockLine(char* line, int* day, double* close);
+Stock* joinChunks(char* filename, LoadChunk* chunks, int chunk_count, int* skipped);
+void loadStocks(StockList* stocks, char** files, int file_count, bool compress);
+void runLoadPhase(LoadJob* job, LoadPhase phase, int tasks);
+void* runLoader(void* arg);
+double monotonicSeconds();
 int endsWith(const char *str, const char *suffix);
 StockList* init_stock_list();
 void append_stock(StockList* stock_list, Stock* stock);
 char* get_csv_stock_name(const char *filename);
 char* getStockName(Stock* stock);
-int getIndex(char** theList, char* val);
+int getIndex(Stock* stock, int day);
+double closeAt(Stock* stock, int row);
+int dayAt(Stock* stock, int row);
 char* roundUp(char* str);
-char** getDates(char* start, char* end, char* filename);
-bool dateIsBefore(char* date1, char* date2);
-char** getPrices(char* start, char* end, char* filename);
 bool validDate(char* date);
-float calculateMaxProfit(char** prices);
-bool validBorderDates(char** dates, char* start, char* end);
+int parseDay(char* date);
+void formatDay(int day, char* out);
+float calculateMaxProfit(double* prices, int size);
+bool validBorderDates(Stock* stock, int start, int end, int* first, int* last);
+size_t writeVarint(unsigned char* out, int64_t value);
+size_t readVarint(unsigned char* in, int64_t* value);
+void packStock(Stock* stock);
+int unpackBlock(PackedColumn* packed, int block, int* days, int64_t* prices);
+void buildCalendar(Stock* stock, bool compact);
+float packedMaxProfit(Stock* stock, int first, int last);
+Stock* findStock(StockList* stocks, char* name);
+double* getCloses(Stock* stock, int first, int last, bool* owned);
+int* getDays(Stock* stock, int first, int last, bool* owned);
+double* alignedColumn(int size);
+int logReturns(double* closes, int size, double* returns);
+double sumVector(const double* x, int size);
+double squaredDeviations(const double* x, int size, double mean);
+void centeredSums(const double* x, const double* y, int size, double mean_x, double mean_y, double* sxx, double* syy, double* sxy);
+bool positiveCloses(double* closes, int size);
+bool volatility(double* closes, int size, double* result);
+bool maxDrawdown(double* closes, int size, double* result);
+bool correlation(Stock* a, int first_a, int last_a, Stock* b, int first_b, int last_b, double* result);
+double maxProfitK(double* prices, int size, int k, double fee, int cooldown);
+double maxProfitUnlimited(double* prices, int size, double fee, int cooldown);
+double* liveCloses(Stock* stock);
+char* appendBars(StockList* stocks, char** args, char* request);
+void appendRow(Stock* stock, int day, double close);
+void extendCalendar(Stock* stock, int day, int row);
+void replayAppendLog(char* path, StockList* stocks);
+char* subscribeClient(StockList* stocks, char** args);
+void startSubscriptionHub();
+void notifySubscribers();
+void* runSubscriptionHub(void* arg);
+bool fillSubscriber(Subscriber* subscriber);
+bool flushSubscriber(Subscriber* subscriber);
+bool parseLogLevel(char* arg, LogLevel* level);
+void logRecord(LogLevel level, const char* text);
+void logRequest(const char* command);
+void startLogger();
+void* runLogger(void* arg);
+int drainLogs();
+void writeLogs(char* data, int length);
+void flushLogs();
+void retireLogRing(void* ring);
+bool parseBackend(char* arg, Backend* backend);
+int openServerSocket(char* port, bool reuse_port);
+void serve(int server_fd, StockList* stocks, Backend backend);
+void superviseWorkers(int workers, char* port, StockList* stocks, Backend backend);
+pid_t spawnWorker(char* port, StockList* stocks, Backend backend);
+void forwardShutdown(int sig);
+void* waitForTermination(void* arg);
+void runBlockingLoop(int server_fd, StockList* stocks);
+int openUnixSocket(char* path);
+bool trustedPeer(int fd);
+#ifdef __linux__
+void* runShmAcceptor(void* stocks);
+void attachShmClient(int connection, StockList* stocks);
+void detachShmClient(ShmSession* session, int memory_fd);
+void* runShmSession(void* session);
+bool respondToReadyClient(int client_socket, StockList* stocks, bool trusted);
+bool writeAll(int fd, char* data, size_t length);
+bool runEpollLoop(int server_fd, StockList* stocks);
+bool runUringLoop(int server_fd, StockList* stocks);
+#endif
 
 int s_socket;
-int c_socket;
 
+// The connection being answered. Shared memory sessions answer on threads of their own (and set it to -1 as they
+// have no socket to push to), so every thread keeps its own.
+__thread int c_socket = -1;
+
+// Set when that connection came in on the unix socket (or the shared memory one) from our own user or root. Only
+// those may Append, the TCP port is open to anyone who can reach it.
+__thread bool c_trusted = false;
+
+// Optional same-host listeners, -1 when not in use
+int u_socket = -1;
+int shm_socket = -1;
+char* unix_path = NULL;
+char* shm_path = NULL;
+
+// Set in the supervisor process when it is asked to stop
+volatile sig_atomic_t shutdown_requested = 0;
+
+// Appends take turns (shm sessions each run on a thread of their own) but queries never wait for them.
+// Workers each hold a private copy of the data, so Append is turned off rather than updating just one of them.
+pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+bool appends_allowed = true;
+int append_log = -1;
+
+// Subscribers are looked after by a thread of their own, woken through a pipe whenever bars are appended. Only
+// the first append after each wakeup writes to the pipe, the rest see hub_signaled and leave it be.
+pthread_once_t hub_started = PTHREAD_ONCE_INIT;
+pthread_mutex_t hub_lock = PTHREAD_MUTEX_INITIALIZER;
+Subscriber* hub_joining = NULL;
+int hub_wakeup[2] = {-1, -1};
+bool hub_signaled = false;
+
+// Set from --log, --log-level and --log-sample. Only one request in every log_sample_every is logged.
+int log_fd = STDOUT_FILENO;
+LogLevel log_level = LOG_INFO;
+int log_sample_every = 1;
+
+LogRing* log_rings = NULL;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t log_ring_key;
+pthread_once_t log_started = PTHREAD_ONCE_INIT;
+int log_threads = 0;
+
+__thread LogRing* log_ring = NULL;
+__thread unsigned log_requests = 0;
+
+#ifdef TRACE
+// Where the trace goes and how many requests we skip between sampled ones
+char* trace_path = "trace.json";
+int trace_sample_every = 1;
+#endif
+
+// bench.c includes this file for the query code and brings its own main
+#ifndef SERVER_NO_MAIN
 int main(int argc, char** argv)
 {
     StockList* stocks = init_stock_list();
@@ -52,28 +422,211 @@ int main(int argc, char** argv)
     char ch[5] = ".csv";
     int index = 0;
     bool csvExists = false;
-
-    // Computer reads stock data from csv files
+    char* port = NULL;
+    int workers = 0;
+    bool compress = false;
+    char* append_log_path = NULL;
+
+    // Event loops are only available on Linux, everything else keeps the original accept loop
+#ifdef __linux__
+    Backend backend = BACKEND_EPOLL;
+#else
+    Backend backend = BACKEND_BLOCKING;
+#endif
+
+    // Options can come in any order so look at them all before loading anything
     while (argv[index] != NULL)
     {
         // True if the argument refers to a csv file
         if (endsWith(argv[index], ch))
         {
-            Stock* s = read_stock_data(argv[index]);
-            append_stock(stocks, s);
             csvExists = true;
         }
+        else if (strcmp(argv[index], "--compress") == 0)
+        {
+            compress = true;
+        }
+        else if (strncmp(argv[index], "--backend=", 10) == 0)
+        {
+            if (!parseBackend(argv[index] + 10, &backend))
+            {
+                fprintf(stderr, "Error: Unknown backend '%s' (expected blocking, epoll or uring).\n", argv[index] + 10);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[index], "--unix=", 7) == 0)
+        {
+            unix_path = argv[index] + 7;
+        }
+        else if (strncmp(argv[index], "--shm=", 6) == 0)
+        {
+            shm_path = argv[index] + 6;
+        }
+        else if (strncmp(argv[index], "--append-log=", 13) == 0)
+        {
+            append_log_path = argv[index] + 13;
+        }
+        else if (strncmp(argv[index], "--log=", 6) == 0)
+        {
+            log_fd = open(argv[index] + 6, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (log_fd < 0)
+            {
+                perror("Error: Unable to open log file");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[index], "--log-level=", 12) == 0)
+        {
+            if (!parseLogLevel(argv[index] + 12, &log_level))
+            {
+                fprintf(stderr, "Error: Unknown log level '%s' (expected error, warn, info or debug).\n", argv[index] + 12);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[index], "--log-sample=", 13) == 0)
+        {
+            log_sample_every = atoi(argv[index] + 13);
+            if (log_sample_every < 1)
+            {
+                fprintf(stderr, "Error: --log-sample needs a positive number of requests.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[index], "--trace", 7) == 0)
+        {
+#ifdef TRACE
+            if (strncmp(argv[index], "--trace=", 8) == 0)
+            {
+                trace_path = argv[index] + 8;
+            }
+            else if (strncmp(argv[index], "--trace-sample=", 15) == 0)
+            {
+                trace_sample_every = atoi(argv[index] + 15);
+                if (trace_sample_every < 1)
+                {
+                    fprintf(stderr, "Error: --trace-sample needs a positive number of requests.\n");
+                    exit(1);
+                }
+            }
+            else
+            {
+                fprintf(stderr, "Error: Unknown option '%s'.\n", argv[index]);
+                exit(1);
+            }
+#else
+            fprintf(stderr, "Error: %s needs a server built with -DTRACE.\n", argv[index]);
+            exit(1);
+#endif
+        }
+        else if (strncmp(argv[index], "--workers=", 10) == 0)
+        {
+            workers = atoi(argv[index] + 10);
+            if (workers < 1)
+            {
+                fprintf(stderr, "Error: --workers needs a positive number of worker processes.\n");
+                exit(1);
+            }
+        }
+        // Anything else starting with -- is a mistyped option, not a port to listen on
+        else if (strncmp(argv[index], "--", 2) == 0)
+        {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[index]);
+            exit(1);
+        }
+        else if (index > 0)
+        {
+            if (port != NULL)
+            {
+                fprintf(stderr, "Error: Only one port number can be given, got '%s' and '%s'.\n", port, argv[index]);
+                exit(1);
+            }
+
+            char* end;
+            long number = strtol(argv[index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || number < 1 || number > 65535)
+            {
+                fprintf(stderr, "Error: '%s' is not a csv file or a port number (1-65535).\n", argv[index]);
+                exit(1);
+            }
+            port = argv[index];
+        }
             
         index++;
     }
 
     // Must provide valid command with proper arguments when starting the server
-    if (index <= 2 || !csvExists)
+    if (port == NULL || !csvExists)
     {
         perror("Error: Must provide arguments for at least one csv file, and the port number that the server will listen to.");
         exit(1);
     }
 
+    // Computer reads stock data from csv files, all of them at once
+    char** files = malloc(argc * sizeof(char*));
+    int file_count = 0;
+    for (index = 1; argv[index] != NULL; index++)
+    {
+        if (endsWith(argv[index], ch))
+            files[file_count++] = argv[index];
+    }
+
+    loadStocks(stocks, files, file_count, compress);
+    free(files);
+
+    // Bars appended before a crash or restart are replayed on top of the csv files, new ones are added to the end
+    if (append_log_path != NULL)
+    {
+        replayAppendLog(append_log_path, stocks);
+
+        append_log = open(append_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (append_log < 0)
+        {
+            perror("Error: Unable to open append log");
+            exit(1);
+        }
+    }
+
+    if (workers > 0)
+        appends_allowed = false;
+
+    // A unix socket path can't be shared with SO_REUSEPORT, so these are opened once and inherited by every worker
+    if (unix_path != NULL)
+    {
+        u_socket = openUnixSocket(unix_path);
+
+        // Several processes may be waiting on it, whoever loses the race just goes back to waiting
+        fcntl(u_socket, F_SETFL, fcntl(u_socket, F_GETFL) | O_NONBLOCK);
+    }
+
+    if (shm_path != NULL)
+    {
+#ifdef __linux__
+        shm_socket = openUnixSocket(shm_path);
+#else
+        fprintf(stderr, "Error: The shared memory transport is only available on Linux.\n");
+        exit(1);
+#endif
+    }
+
+    // Every worker gets its own listening socket and the kernel spreads connections between them. They all
+    // share the price data loaded above, since fork() hands it to them copy-on-write instead of re-reading it.
+    if (workers > 0)
+        superviseWorkers(workers, port, stocks, backend);
+
+    int server_fd = openServerSocket(port, false);
+
+#ifdef TRACE
+    atexit(traceFlush);
+#endif
+
+    printf("server started\n");
+
+    serve(server_fd, stocks, backend);
+}
+#endif
+
+int openServerSocket(char* port, bool reuse_port)
+{
     // Creates a socket represented as the server's file descriptor
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) 
@@ -87,11 +640,18 @@ int main(int argc, char** argv)
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(yes)) < 0)
         perror("Error: Unable for server to establish connection.");
 
+    // Lets several worker processes bind the same port
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, (void*)&yes, sizeof(yes)) < 0)
+    {
+        perror("Error: Unable to share the port between workers.");
+        exit(1);
+    }
+
     // Bind the socket to a port
     struct sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(atoi(argv[index - 1]));
+    server_address.sin_port = htons(atoi(port));
     if (bind(server_fd, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) 
     {
         perror("Error: Unable to bind.");
@@ -99,17 +659,293 @@ int main(int argc, char** argv)
     }
 
     // Allows socket to now accept incoming connections from the client
-    listen(server_fd, 5);
+    // Dashboards tend to (re)subscribe all at once, a short queue would leave most of them waiting on SYN retries
+    listen(server_fd, SOMAXCONN);
     s_socket = server_fd;
 
-    printf("server started\n");
+    return server_fd;
+}
+
+int openUnixSocket(char* path)
+{
+    int unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unix_fd < 0)
+    {
+        perror("Error: Unable to open unix socket.");
+        exit(1);
+    }
+
+    struct sockaddr_un unix_address;
+    memset(&unix_address, 0, sizeof(unix_address));
+    unix_address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(unix_address.sun_path))
+    {
+        fprintf(stderr, "Error: Unix socket path %s is too long.\n", path);
+        exit(1);
+    }
+    strcpy(unix_address.sun_path, path);
+
+    // Clear out whatever a previous run left behind
+    unlink(path);
+
+    if (bind(unix_fd, (struct sockaddr*)&unix_address, sizeof(unix_address)) < 0)
+    {
+        perror("Error: Unable to bind unix socket.");
+        exit(1);
+    }
+
+    listen(unix_fd, 64);
+
+    return unix_fd;
+}
+
+// Peers on the unix sockets are trusted when they run as our own user or as root
+bool trustedPeer(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0)
+        return false;
+
+    return peer.uid == geteuid() || peer.uid == 0;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) < 0)
+        return false;
+
+    return uid == geteuid() || uid == 0;
+#endif
+}
+
+void serve(int server_fd, StockList* stocks, Backend backend)
+{
+    // Every worker process needs a log thread of its own, threads don't survive fork()
+    pthread_once(&log_started, startLogger);
+
+#ifdef __linux__
+    // Shared memory clients are served on threads of their own, whatever the backend
+    if (shm_socket >= 0)
+    {
+        pthread_t acceptor;
+        if (pthread_create(&acceptor, NULL, runShmAcceptor, stocks) != 0)
+        {
+            perror("Error: Unable to start shared memory transport");
+            exit(1);
+        }
+        pthread_detach(acceptor);
+    }
+
+    // io_uring needs a 5.19+ kernel (multishot accept and provided buffer rings), so fall back to epoll without it
+    if (backend == BACKEND_URING && !runUringLoop(server_fd, stocks))
+    {
+        fprintf(stderr, "io_uring is not supported by this kernel, falling back to epoll\n");
+        backend = BACKEND_EPOLL;
+    }
+
+    if (backend == BACKEND_EPOLL && !runEpollLoop(server_fd, stocks))
+        backend = BACKEND_BLOCKING;
+#endif
+
+    runBlockingLoop(server_fd, stocks);
+}
+
+pid_t spawnWorker(char* port, StockList* stocks, Backend backend)
+{
+    // Or the worker inherits whatever startup output is still buffered and prints it a second time
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Error: Unable to start worker");
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+
+#ifdef TRACE
+        // One trace file per worker
+        char* worker_trace_path = malloc(strlen(trace_path) + 16);
+        sprintf(worker_trace_path, "%s.%d", trace_path, (int)getpid());
+        trace_path = worker_trace_path;
+
+        atexit(traceFlush);
+#endif
+
+        // The supervisor stops workers with SIGTERM. exit() isn't safe from a signal handler (the atexit flushes
+        // take locks), so block it here, before any other thread exists, and let one thread wait for it instead.
+        sigset_t terminate;
+        sigemptyset(&terminate);
+        sigaddset(&terminate, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &terminate, NULL);
+
+        pthread_t waiter;
+        if (pthread_create(&waiter, NULL, waitForTermination, NULL) != 0)
+        {
+            perror("Error: Unable to start worker");
+            exit(1);
+        }
+        pthread_detach(waiter);
+
+        int server_fd = openServerSocket(port, true);
+        serve(server_fd, stocks, backend);
+        exit(0);
+    }
+
+    return pid;
+}
+
+void forwardShutdown(int sig)
+{
+    shutdown_requested = 1;
+}
+
+// Exits the worker on SIGTERM, with a non-zero status so a worker stopped from outside is still replaced
+void* waitForTermination(void* arg)
+{
+    sigset_t terminate;
+    sigemptyset(&terminate);
+    sigaddset(&terminate, SIGTERM);
+
+    int sig;
+    while (sigwait(&terminate, &sig) != 0)
+        ;
+
+    exit(128 + SIGTERM);
+}
+
+// Keeps the requested number of workers alive. A worker that crashes or hits one of the exit(1) error paths is
+// replaced, while a worker that exits cleanly (someone sent quit) shuts the whole service down.
+void superviseWorkers(int workers, char* port, StockList* stocks, Backend backend)
+{
+    pid_t* worker_pids = malloc(workers * sizeof(pid_t));
+    time_t* started = malloc(workers * sizeof(time_t));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = forwardShutdown;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    for (int i = 0; i < workers; i++)
+    {
+        worker_pids[i] = spawnWorker(port, stocks, backend);
+        started[i] = time(NULL);
+    }
+
+    printf("server started with %d workers\n", workers);
+    fflush(stdout);
+
+    int exit_code = 0;
+
+    while (!shutdown_requested)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("Error: Unable to wait for workers");
+            exit_code = 1;
+            break;
+        }
+
+        int slot = -1;
+        for (int i = 0; i < workers; i++)
+        {
+            if (worker_pids[i] == pid)
+                slot = i;
+        }
+
+        if (slot < 0)
+            continue;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            break;
+
+        fprintf(stderr, "worker %d died (%s %d), restarting it\n", (int)pid, WIFSIGNALED(status) ? "signal" : "status",
+            WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+
+        // Don't spin if the worker can't even get through startup (e.g. the port is taken)
+        if (time(NULL) - started[slot] < 1)
+            sleep(1);
+
+        worker_pids[slot] = spawnWorker(port, stocks, backend);
+        started[slot] = time(NULL);
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (worker_pids[i] > 0)
+            kill(worker_pids[i], SIGTERM);
+    }
+
+    while (waitpid(-1, NULL, 0) > 0)
+        ;
+
+    exit(exit_code);
+}
+
+bool parseBackend(char* arg, Backend* backend)
+{
+    if (strcmp(arg, "blocking") == 0)
+        *backend = BACKEND_BLOCKING;
+    else if (strcmp(arg, "epoll") == 0)
+        *backend = BACKEND_EPOLL;
+    else if (strcmp(arg, "uring") == 0)
+        *backend = BACKEND_URING;
+    else
+        return false;
+
+    return true;
+}
+
+void runBlockingLoop(int server_fd, StockList* stocks)
+{
+    struct pollfd listeners[2];
+    listeners[0].fd = server_fd;
+    listeners[0].events = POLLIN;
+    listeners[1].fd = u_socket;
+    listeners[1].events = POLLIN;
 
     while(1)
     {
+        int listen_fd = server_fd;
+
+        // Only need to wait on both when there is a unix socket as well
+        if (u_socket >= 0)
+        {
+            if (poll(listeners, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                perror("Error: Unable to wait for connections");
+                exit(1);
+            }
+
+            if (listeners[1].revents & POLLIN)
+                listen_fd = u_socket;
+        }
+
         // Accept a connection
-        struct sockaddr_in client_address;
+        TRACE_REQUEST();
+        TRACE_SPAN(accepting, "accept");
+        struct sockaddr_storage client_address;
         int client_address_len = sizeof(client_address);
-        int client_socket = accept(server_fd, (struct sockaddr*)&client_address, (socklen_t*)&client_address_len);
+        int client_socket = accept(listen_fd, (struct sockaddr*)&client_address, (socklen_t*)&client_address_len);
+        TRACE_END(accepting);
+        if (client_socket < 0 && listen_fd == u_socket && (errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+
         if (client_socket < 0) 
         {
             perror("Error: Unable to accept");
@@ -117,6 +953,7 @@ int main(int argc, char** argv)
         }
 
        // Handle the client request in a new thread/process
+       c_trusted = listen_fd == u_socket && trustedPeer(client_socket);
        listenAndRespond(client_socket, stocks);
     }
 }
@@ -127,12 +964,14 @@ void listenAndRespond(int client_socket, StockList* stocks)
     int n;
 
     // Read the client's request
+    TRACE_SPAN(reading, "read");
     n = read(client_socket, buffer, 1023);
     if (n < 0) 
     {
         perror("Error: Unable to read request from client");
         exit(1);
     }
+    TRACE_END(reading);
 
     buffer[n] = '\0';
 
@@ -142,549 +981,3047 @@ void listenAndRespond(int client_socket, StockList* stocks)
     char* response = processRequest(buffer, stocks);
 
     // Send the response back to the client
+    TRACE_SPAN(writing, "write");
     n = write(client_socket, response, strlen(response));
     if (n < 0) 
     {
         perror("Error: Unable to write response back to client");
         exit(1);
     }
+    TRACE_END(writing);
 
     // Close the connection
     close(client_socket);
 }
 
-char* processRequest(char* client_command, StockList* stocks)
+#ifdef __linux__
+
+// Reads one request from a non-blocking client and answers it. Returns false if the client has nothing to read yet.
+bool respondToReadyClient(int client_socket, StockList* stocks, bool trusted)
 {
-    char* response = malloc(1024 * sizeof(char));
-    char** args = split(client_command);
+    char buffer[1024];
 
-    if (strcmp(args[0], "quit") != 0)
-        printf("%s\n", client_command);
+    TRACE_SPAN(reading, "read");
+    int n = read(client_socket, buffer, 1023);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return false;
+    TRACE_END(reading);
 
-    if (args == NULL || *args == NULL)
+    // A broken client only costs us that one connection, not the whole server
+    if (n <= 0)
     {
-        char* temp = malloc(24 * sizeof(char));
-        strcpy(temp, "Invalid syntax");
+        if (n < 0)
+            perror("Error: Unable to read request from client");
 
-        return temp;
+        close(client_socket);
+        return true;
     }
 
-    if (strcmp(args[0], "quit") == 0)
-    {
-        close(c_socket);
-        close(s_socket);
-        
-        exit(0);
-    }
-    else if (strcmp(args[0], "List") == 0)
-    {
-        response[0] = '\0'; 
-        char* temp_name;
+    buffer[n] = '\0';
 
-        for (int i = 0; stocks -> stocks[i] != NULL; i++)
-        {
-            temp_name = getStockName(stocks -> stocks[i]);
-            strcat(response, temp_name);
+    c_socket = client_socket;
+    c_trusted = trusted;
 
-            if (stocks -> stocks[i + 1] != NULL) 
-                strcat(response, " | ");
-        }    
-    }
-    else if (strcmp(args[0], "Prices") == 0 && args[1] != NULL && args[2] != NULL)
-    {
-        response[0] = '\0'; 
-        char* temp_name;
-        int i;
-        bool valid = false;
-        int size = 0;
+    char* response = processRequest(buffer, stocks);
 
-        for (i = 0; stocks -> stocks[i] != NULL; i++)
-            size++;
+    // Most answers fit the socket send buffer in one go, a long List may have to wait for it to drain
+    TRACE_SPAN(writing, "write");
+    if (!writeAll(client_socket, response, strlen(response)))
+        perror("Error: Unable to write response back to client");
+    TRACE_END(writing);
 
-        for (i = 0; stocks -> stocks[i] != NULL; i++)
+    free(response);
+    close(client_socket);
+
+    return true;
+}
+
+// Writes all of data to a non-blocking socket, waiting for room whenever the send buffer is full
+bool writeAll(int fd, char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            if (strcmp(getStockName(stocks -> stocks[i]), args[1]) == 0)
-            {
-                valid = true;
-                break;
-            }
+            struct pollfd writable = {fd, POLLOUT, 0};
+            if (poll(&writable, 1, 1000) <= 0)
+                return false;
+            continue;
         }
+        if (n < 0)
+            return false;
 
-        if (! valid)
+        data += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+// Marks a trusted client in its epoll data, the fd goes in the low 32 bits
+#define EPOLL_TRUSTED (1ULL << 32)
+
+bool runEpollLoop(int server_fd, StockList* stocks)
+{
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+    {
+        perror("Error: Unable to create epoll instance");
+        return false;
+    }
+
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    // Clients on the unix socket carry EPOLL_TRUSTED next to their fd, see c_trusted
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = server_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0)
+    {
+        perror("Error: Unable to watch server socket");
+        close(epoll_fd);
+        return false;
+    }
+
+    event.data.u64 = u_socket;
+    if (u_socket >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, u_socket, &event) < 0)
+    {
+        perror("Error: Unable to watch unix socket");
+        close(epoll_fd);
+        return false;
+    }
+
+    struct epoll_event events[64];
+
+    while (1)
+    {
+        int ready = epoll_wait(epoll_fd, events, 64, -1);
+        if (ready < 0)
         {
-            strcat(response, "Unknown");
+            if (errno == EINTR)
+                continue;
+
+            perror("Error: Unable to wait for events");
+            exit(1);
         }
-        else 
+
+        for (int i = 0; i < ready; i++)
         {
-            Stock* temp;
-            char* nombre = malloc(50 * sizeof(char));
-            if (strcmp(getStockName(stocks -> stocks[i]), "MSFT") == 0)
-                temp = read_stock_data("MSFT.csv");
-            else
-                temp = read_stock_data("TSLA.csv");
+            int fd = (int)(events[i].data.u64 & 0xffffffff);
+            bool trusted = events[i].data.u64 & EPOLL_TRUSTED;
 
-            int index = getIndex(temp -> dates, args[2]);
-            
-            // Date does not exist
-            if (index == -1)
+            if (fd != server_fd && fd != u_socket)
             {
-                strcat(response, "Unknown");
+                // Spurious wakeup, the one shot registration has to be armed again or the client is never answered
+                if (!respondToReadyClient(fd, stocks, trusted))
+                {
+                    event.events = EPOLLIN | EPOLLONESHOT;
+                    event.data = events[i].data;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0)
+                    {
+                        perror("Error: Unable to watch client socket");
+                        close(fd);
+                    }
+                }
+                continue;
             }
-            else 
-            {     
-                strcat(response, roundUp(temp -> prices[index]));
+
+            // Drain every pending connection, most clients will already have sent their request by now
+            while (1)
+            {
+                TRACE_REQUEST();
+                TRACE_SPAN(accepting, "accept");
+                int client_socket = accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+                TRACE_END(accepting);
+                if (client_socket < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        perror("Error: Unable to accept");
+                    break;
+                }
+
+                trusted = fd == u_socket && trustedPeer(client_socket);
+                if (respondToReadyClient(client_socket, stocks, trusted))
+                    continue;
+
+                // One shot, as a subscriber's connection stays open (and registered) after we close our end of it
+                event.events = EPOLLIN | EPOLLONESHOT;
+                event.data.u64 = (uint64_t)client_socket | (trusted ? EPOLL_TRUSTED : 0);
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0)
+                {
+                    perror("Error: Unable to watch client socket");
+                    close(client_socket);
+                }
             }
         }
     }
-    else if (strcmp(args[0], "MaxProfit") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL)
-    {
-        response[0] = '\0'; 
-        char* temp_name;
-        int i;
-        bool valid = false;
+}
 
-        for (i = 0; stocks -> stocks[i] != NULL; i++)
+void* runShmAcceptor(void* stocks)
+{
+    while (1)
+    {
+        int connection = accept(shm_socket, NULL, NULL);
+        if (connection < 0)
         {
-            if (strcmp(getStockName(stocks -> stocks[i]), args[1]) == 0)
+            if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                perror("Error: Unable to accept shared memory client");
+
+            // Out of descriptors or memory, trying again straight away would only spin until a client leaves
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
             {
-                valid = true;
-                break;
+                struct timespec backoff = { 0, SHM_ACCEPT_BACKOFF_NS };
+                nanosleep(&backoff, NULL);
             }
+            continue;
         }
 
-        // Unknown stock
-        if (! valid)
+        attachShmClient(connection, (StockList*)stocks);
+    }
+
+    return NULL;
+}
+
+// Sets up a ring pair for a new client and hands it the memfd and both eventfds. The connection itself stays
+// open only so we notice when the client goes away.
+void attachShmClient(int connection, StockList* stocks)
+{
+    ShmSession* session = malloc(sizeof(ShmSession));
+    if (session == NULL)
+    {
+        perror("Error: Unable to set up shared memory for client");
+        close(connection);
+        return;
+    }
+
+    session->connection = connection;
+    session->stocks = stocks;
+    session->channel = NULL;
+    session->trusted = trustedPeer(connection);
+
+    int memory_fd = memfd_create("stock-shm", MFD_CLOEXEC);
+    session->request_event = eventfd(0, EFD_CLOEXEC);
+    session->response_event = eventfd(0, EFD_CLOEXEC);
+
+    if (memory_fd < 0 || session->request_event < 0 || session->response_event < 0 || ftruncate(memory_fd, sizeof(ShmChannel)) < 0)
+    {
+        perror("Error: Unable to set up shared memory for client");
+        detachShmClient(session, memory_fd);
+        return;
+    }
+
+    session->channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    if (session->channel == MAP_FAILED)
+    {
+        session->channel = NULL;
+        perror("Error: Unable to map shared memory for client");
+        detachShmClient(session, memory_fd);
+        return;
+    }
+
+    int fds[3] = { memory_fd, session->request_event, session->response_event };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    char ok[3] = "OK";
+    struct iovec data = { ok, 2 };
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    pthread_t thread;
+    if (sendmsg(connection, &message, 0) < 0 || pthread_create(&thread, NULL, runShmSession, session) != 0)
+    {
+        perror("Error: Unable to hand shared memory to client");
+        detachShmClient(session, memory_fd);
+        return;
+    }
+
+    pthread_detach(thread);
+    close(memory_fd);
+}
+
+// Undoes whatever attachShmClient got through before it failed
+void detachShmClient(ShmSession* session, int memory_fd)
+{
+    if (session->channel != NULL)
+        munmap(session->channel, sizeof(ShmChannel));
+    if (memory_fd >= 0)
+        close(memory_fd);
+    if (session->request_event >= 0)
+        close(session->request_event);
+    if (session->response_event >= 0)
+        close(session->response_event);
+
+    close(session->connection);
+    free(session);
+}
+
+void* runShmSession(void* arg)
+{
+    ShmSession* session = arg;
+    ShmRing* requests = &session->channel->requests;
+    ShmRing* responses = &session->channel->responses;
+
+    struct pollfd waiting[2];
+    waiting[0].fd = session->request_event;
+    waiting[0].events = POLLIN;
+    waiting[1].fd = session->connection;
+    waiting[1].events = POLLIN;
+    bool hung_up = false;
+
+    while (!hung_up)
+    {
+        if (poll(waiting, 2, -1) < 0)
         {
-            strcat(response, "Unknown");
+            if (errno == EINTR)
+                continue;
+            break;
         }
-        else 
+
+        // The client never writes to the connection, so anything here means it hung up
+        if (waiting[1].revents)
+            break;
+
+        uint64_t wakeups;
+        if (read(session->request_event, &wakeups, sizeof(wakeups)) < 0)
+            continue;
+
+        uint32_t head = requests->head;
+
+        while (head != __atomic_load_n(&requests->tail, __ATOMIC_ACQUIRE))
         {
-            char** prices;
-            char** dates;
-            
-            if (strcmp(args[1], "MSFT") == 0)
+            char buffer[SHM_SLOT_SIZE];
+            memcpy(buffer, requests->slots[head % SHM_SLOTS], SHM_SLOT_SIZE);
+            buffer[SHM_SLOT_SIZE - 1] = '\0';
+
+            head++;
+            __atomic_store_n(&requests->head, head, __ATOMIC_RELEASE);
+
+            c_socket = -1;
+            c_trusted = session->trusted;
+            TRACE_REQUEST();
+            char* response = processRequest(buffer, session->stocks);
+
+            // The client waits for each answer before asking again, so the ring is only full if it misbehaves. Check
+            // on it every SHM_FULL_WAIT_MS rather than spinning, and give up on it once it hangs up.
+            uint32_t tail = responses->tail;
+            while (!hung_up && tail - __atomic_load_n(&responses->head, __ATOMIC_ACQUIRE) >= SHM_SLOTS)
             {
-                dates = getDates(args[2], args[3], "MSFT.csv");
-                prices = getPrices(args[2], args[3], "MSFT.csv");
+                if (poll(&waiting[1], 1, SHM_FULL_WAIT_MS) > 0)
+                    hung_up = true;
             }
-            else 
+
+            if (hung_up)
             {
-                dates = getDates(args[2], args[3], "TSLA.csv");
-                prices = getPrices(args[2], args[3], "TSLA.csv");
+                free(response);
+                break;
             }
 
-            if (! validBorderDates(dates, args[2], args[3]))
+            // Anything longer than a slot (List with a lot of tickers) is cut short and ends in "..."
+            char* slot = responses->slots[tail % SHM_SLOTS];
+            strncpy(slot, response, SHM_SLOT_SIZE - 1);
+            slot[SHM_SLOT_SIZE - 1] = '\0';
+            if (strlen(response) >= SHM_SLOT_SIZE)
+                strcpy(slot + SHM_SLOT_SIZE - 4, "...");
+            __atomic_store_n(&responses->tail, tail + 1, __ATOMIC_RELEASE);
+
+            uint64_t one = 1;
+            if (write(session->response_event, &one, sizeof(one)) < 0)
+                perror("Error: Unable to wake shared memory client");
+
+            free(response);
+        }
+    }
+
+    munmap(session->channel, sizeof(ShmChannel));
+    close(session->request_event);
+    close(session->response_event);
+    close(session->connection);
+    free(session);
+
+    return NULL;
+}
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 1024
+#define URING_BUFFER_GROUP 0
+
+// The low two bits of each submission's user_data say what completed, the rest is the fd (or the response to free)
+#define URING_ACCEPT 0
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_CLOSE 3
+#define URING_TRUSTED (1ULL << 62)
+#define URING_FD(user_data) ((int)(((user_data) & ~URING_TRUSTED) >> 2))
+
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned pending;
+
+    struct io_uring_buf_ring* buf_ring;
+    char* buffers;
+    unsigned short buf_tail;
+} URing;
+
+int uringEnter(URing* ring, unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+bool uringSetup(URing* ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(URing));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return false;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(ring->fd);
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char* rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_head = (unsigned*)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(rings + params.sq_off.array);
+    ring->cq_head = (unsigned*)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+    // Receives pick their buffer out of this ring so no memory is pinned for idle connections
+    ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if (ring->buf_ring == MAP_FAILED || ring->buffers == NULL)
+    {
+        close(ring->fd);
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    // Provided buffer rings came in the same kernel release as multishot accept, so this doubles as our feature check
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        close(ring->fd);
+        return false;
+    }
+
+    return true;
+}
+
+// Hands a receive buffer back to the kernel once we are done with its contents
+void uringRecycleBuffer(URing* ring, unsigned short buffer_id)
+{
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + buffer_id * URING_BUFFER_SIZE);
+    // Leave a byte spare so the request can be NUL terminated in place
+    buf->len = URING_BUFFER_SIZE - 1;
+    buf->bid = buffer_id;
+
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe* uringGetSqe(URing* ring)
+{
+    unsigned tail = *ring->sq_tail;
+
+    // Queue is full, push what we have to the kernel to make room
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries)
+    {
+        int submitted = uringEnter(ring, ring->pending, 0);
+        if (submitted > 0)
+            ring->pending -= submitted;
+    }
+
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+
+    return sqe;
+}
+
+void uringQueueAccept(URing* ring, int server_fd)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ((uint64_t)server_fd << 2) | URING_ACCEPT;
+}
+
+void uringQueueRecv(URing* ring, int client_socket, bool trusted)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client_socket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = ((uint64_t)client_socket << 2) | URING_RECV | (trusted ? URING_TRUSTED : 0);
+}
+
+// Clients only ever send one request, so the send is hard linked to the close and both go out in one submission
+void uringQueueSendAndClose(URing* ring, int client_socket, char* response)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client_socket;
+    sqe->addr = (uint64_t)(uintptr_t)response;
+    sqe->len = strlen(response);
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->user_data = (uint64_t)(uintptr_t)response | URING_SEND;
+
+    sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = client_socket;
+    sqe->user_data = ((uint64_t)client_socket << 2) | URING_CLOSE;
+}
+
+bool runUringLoop(int server_fd, StockList* stocks)
+{
+    URing ring;
+    if (!uringSetup(&ring))
+        return false;
+
+    for (unsigned short i = 0; i < URING_BUFFERS; i++)
+        uringRecycleBuffer(&ring, i);
+
+    uringQueueAccept(&ring, server_fd);
+    if (u_socket >= 0)
+        uringQueueAccept(&ring, u_socket);
+
+    while (1)
+    {
+        // One syscall both submits everything queued by the last batch and waits for the next one
+        int submitted = uringEnter(&ring, ring.pending, 1);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("Error: Unable to submit to io_uring");
+            exit(1);
+        }
+        ring.pending -= submitted;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            int type = cqe->user_data & 3;
+            int res = cqe->res;
+
+            if (type == URING_ACCEPT)
             {
-                strcat(response, "Unknown");
+                if (res >= 0)
+                    uringQueueRecv(&ring, res, URING_FD(cqe->user_data) == u_socket && trustedPeer(res));
+                else
+                    fprintf(stderr, "Error: Unable to accept: %s\n", strerror(-res));
+
+                // The kernel drops a multishot accept when it runs into trouble, so arm a new one
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    uringQueueAccept(&ring, URING_FD(cqe->user_data));
             }
-            else 
+            else if (type == URING_RECV)
             {
-                float maxProfit = calculateMaxProfit(prices);
-                char* numString = malloc(20 * sizeof(char));
-                sprintf(numString, "%f", maxProfit);
+                int client_socket = URING_FD(cqe->user_data);
+                bool trusted = cqe->user_data & URING_TRUSTED;
 
-                strcat(response, roundUp(numString));
+                if (res == -ENOBUFS)
+                {
+                    // Every buffer is in use, try again once some have been handed back
+                    uringQueueRecv(&ring, client_socket, trusted);
+                    continue;
+                }
+
+                if (res <= 0)
+                {
+                    if (res < 0)
+                        fprintf(stderr, "Error: Unable to read request from client: %s\n", strerror(-res));
+
+                    struct io_uring_sqe* sqe = uringGetSqe(&ring);
+                    sqe->opcode = IORING_OP_CLOSE;
+                    sqe->fd = client_socket;
+                    sqe->user_data = ((uint64_t)client_socket << 2) | URING_CLOSE;
+                    continue;
+                }
+
+                unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                char* buffer = ring.buffers + buffer_id * URING_BUFFER_SIZE;
+                buffer[res] = '\0';
+
+                c_socket = client_socket;
+                c_trusted = trusted;
+
+                // The socket I/O itself happens inside the kernel here, so only the request processing is traced
+                TRACE_REQUEST();
+                char* response = processRequest(buffer, stocks);
+                uringRecycleBuffer(&ring, buffer_id);
+                uringQueueSendAndClose(&ring, client_socket, response);
+            }
+            else if (type == URING_SEND)
+            {
+                if (res < 0)
+                    fprintf(stderr, "Error: Unable to write response back to client: %s\n", strerror(-res));
+
+                free((char*)(uintptr_t)(cqe->user_data & ~(uint64_t)3));
             }
         }
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
     }
-    else // Client should be responsible for making sure queries are valid before being sent but this is here just in case
+}
+
+#endif
+
+char* processRequest(char* client_command, StockList* stocks)
+{
+    char* response = malloc(1024 * sizeof(char));
+
+    TRACE_SPAN(splitting, "split");
+    char** args = split(client_command);
+    TRACE_END(splitting);
+
+    if (args == NULL || *args == NULL)
     {
         char* temp = malloc(24 * sizeof(char));
         strcpy(temp, "Invalid syntax");
+
         return temp;
     }
 
-    return response;
+    if (strcmp(args[0], "quit") != 0)
+        logRequest(client_command);
+
+    if (strcmp(args[0], "quit") == 0)
+    {
+        close(c_socket);
+        close(s_socket);
+
+        if (unix_path != NULL)
+            unlink(unix_path);
+        if (shm_path != NULL)
+            unlink(shm_path);
+        
+        exit(0);
+    }
+    else if (strcmp(args[0], "List") == 0)
+    {
+        char* temp_name;
+
+        // gen.c makes thousands of tickers, so size the answer to fit them all
+        size_t length = 1;
+        for (int i = 0; stocks -> stocks[i] != NULL; i++)
+            length += strlen(getStockName(stocks -> stocks[i])) + 3;
+
+        if (length > 1024)
+            response = realloc(response, length);
+        response[0] = '\0'; 
+
+        for (int i = 0; stocks -> stocks[i] != NULL; i++)
+        {
+            temp_name = getStockName(stocks -> stocks[i]);
+            strcat(response, temp_name);
+
+            if (stocks -> stocks[i + 1] != NULL) 
+                strcat(response, " | ");
+        }    
+    }
+    else if (strcmp(args[0], "Prices") == 0 && args[1] != NULL && args[2] != NULL)
+    {
+        response[0] = '\0'; 
+        char* temp_name;
+        int i;
+        bool valid = false;
+        int size = 0;
+
+        for (i = 0; stocks -> stocks[i] != NULL; i++)
+            size++;
+
+        TRACE_SPAN(lookup, "ticker lookup");
+        for (i = 0; stocks -> stocks[i] != NULL; i++)
+        {
+            if (strcmp(getStockName(stocks -> stocks[i]), args[1]) == 0)
+            {
+                valid = true;
+                break;
+            }
+        }
+        TRACE_END(lookup);
+
+        if (! valid)
+        {
+            strcat(response, "Unknown");
+        }
+        else 
+        {
+            Stock* temp = stocks -> stocks[i];
+
+            TRACE_SPAN(resolving, "range resolve");
+            int index = getIndex(temp, parseDay(args[2]));
+            TRACE_END(resolving);
+            
+            // Date does not exist
+            if (index == -1)
+            {
+                strcat(response, "Unknown");
+            }
+            else 
+            {     
+                TRACE_SPAN(formatting, "format");
+                char* numString = malloc(20 * sizeof(char));
+                sprintf(numString, "%f", closeAt(temp, index));
+
+                strcat(response, roundUp(numString));
+            }
+        }
+    }
+    else if (strcmp(args[0], "MaxProfit") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL)
+    {
+        response[0] = '\0'; 
+        char* temp_name;
+        int i;
+        bool valid = false;
+
+        TRACE_SPAN(lookup, "ticker lookup");
+        for (i = 0; stocks -> stocks[i] != NULL; i++)
+        {
+            if (strcmp(getStockName(stocks -> stocks[i]), args[1]) == 0)
+            {
+                valid = true;
+                break;
+            }
+        }
+        TRACE_END(lookup);
+
+        // Unknown stock
+        if (! valid)
+        {
+            strcat(response, "Unknown");
+        }
+        else 
+        {
+            Stock* temp = stocks -> stocks[i];
+            int first, last;
+
+            TRACE_SPAN(resolving, "range resolve");
+            bool inRange = validBorderDates(temp, parseDay(args[2]), parseDay(args[3]), &first, &last);
+            TRACE_END(resolving);
+
+            if (! inRange)
+            {
+                strcat(response, "Unknown");
+            }
+            else 
+            {
+                TRACE_SPAN(computing, "compute");
+                float maxProfit;
+                if (temp -> packed != NULL)
+                    maxProfit = packedMaxProfit(temp, first, last);
+                else
+                    maxProfit = calculateMaxProfit(liveCloses(temp) + first, last - first + 1);
+                TRACE_END(computing);
+
+                TRACE_SPAN(formatting, "format");
+                char* numString = malloc(20 * sizeof(char));
+                sprintf(numString, "%f", maxProfit);
+
+                strcat(response, roundUp(numString));
+            }
+        }
+    }
+    else if (strcmp(args[0], "MaxProfitK") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL && args[4] != NULL)
+    {
+        response[0] = '\0';
+
+        // Fee and cooldown are optional and default to a plain K transaction query
+        // Both are range checked as longs first, (int)strtol would quietly wrap anything too big
+        char* end;
+        long k = strtol(args[4], &end, 10);
+        bool valid = *end == '\0' && k > 0 && k <= INT_MAX;
+
+        double fee = 0;
+        if (valid && args[5] != NULL)
+        {
+            fee = strtod(args[5], &end);
+            valid = *end == '\0' && fee >= 0;
+        }
+
+        long cooldown = 0;
+        if (valid && args[5] != NULL && args[6] != NULL)
+        {
+            cooldown = strtol(args[6], &end, 10);
+            valid = *end == '\0' && cooldown >= 0 && cooldown <= INT_MAX && args[7] == NULL;
+        }
+
+        TRACE_SPAN(lookup, "ticker lookup");
+        Stock* temp = findStock(stocks, args[1]);
+        TRACE_END(lookup);
+
+        TRACE_SPAN(resolving, "range resolve");
+        int first, last;
+        bool inRange = valid && temp != NULL && validBorderDates(temp, parseDay(args[2]), parseDay(args[3]), &first, &last);
+        TRACE_END(resolving);
+
+        if (! valid)
+        {
+            strcpy(response, "Invalid syntax");
+        }
+        else if (! inRange)
+        {
+            strcat(response, "Unknown");
+        }
+        else
+        {
+            TRACE_SPAN(computing, "compute");
+            bool owned;
+            double* prices = getCloses(temp, first, last, &owned);
+            int size = last - first + 1;
+
+            // Each trade takes a buy day and a sell day with cooldown days between trades, so no more than
+            // (size + cooldown) / (cooldown + 2) of them fit. Once k reaches that it can never bind, so skip the
+            // K dimension, which also keeps the DP state O(size) however big k and cooldown are.
+            long most_trades = (size + cooldown) / (cooldown + 2);
+            double profit;
+            if (k >= most_trades)
+                profit = maxProfitUnlimited(prices, size, fee, cooldown);
+            else
+                profit = maxProfitK(prices, size, k, fee, cooldown);
+            TRACE_END(computing);
+
+            // NAN when the table didn't fit in memory
+            TRACE_SPAN(formatting, "format");
+            if (isnan(profit))
+                strcpy(response, "Unknown");
+            else
+                sprintf(response, "%.2f", profit);
+
+            if (owned)
+                free(prices);
+        }
+    }
+    else if ((strcmp(args[0], "Volatility") == 0 || strcmp(args[0], "MaxDrawdown") == 0) && args[1] != NULL && args[2] != NULL && args[3] != NULL)
+    {
+        TRACE_SPAN(lookup, "ticker lookup");
+        Stock* temp = findStock(stocks, args[1]);
+        TRACE_END(lookup);
+
+        TRACE_SPAN(resolving, "range resolve");
+        int first, last;
+        bool inRange = temp != NULL && validBorderDates(temp, parseDay(args[2]), parseDay(args[3]), &first, &last);
+        TRACE_END(resolving);
+
+        strcpy(response, "Unknown");
+        if (inRange)
+        {
+            TRACE_SPAN(computing, "compute");
+            bool owned;
+            double* prices = getCloses(temp, first, last, &owned);
+            int size = last - first + 1;
+
+            double result;
+            bool defined;
+            if (strcmp(args[0], "Volatility") == 0)
+                defined = volatility(prices, size, &result);
+            else
+                defined = maxDrawdown(prices, size, &result);
+            TRACE_END(computing);
+
+            TRACE_SPAN(formatting, "format");
+            if (defined)
+                sprintf(response, "%.2f", result);
+
+            if (owned)
+                free(prices);
+        }
+    }
+    else if (strcmp(args[0], "Correlation") == 0 && args[1] != NULL && args[2] != NULL && args[3] != NULL && args[4] != NULL)
+    {
+        TRACE_SPAN(lookup, "ticker lookup");
+        Stock* a = findStock(stocks, args[1]);
+        Stock* b = findStock(stocks, args[2]);
+        TRACE_END(lookup);
+
+        // Both tickers have to have traded on the first and last day, what happens in between can differ
+        TRACE_SPAN(resolving, "range resolve");
+        int start = parseDay(args[3]), end = parseDay(args[4]);
+        int first_a, last_a, first_b, last_b;
+        bool inRange = a != NULL && b != NULL && validBorderDates(a, start, end, &first_a, &last_a)
+            && validBorderDates(b, start, end, &first_b, &last_b);
+        TRACE_END(resolving);
+
+        strcpy(response, "Unknown");
+        if (inRange)
+        {
+            TRACE_SPAN(computing, "compute");
+            double result;
+            bool defined = correlation(a, first_a, last_a, b, first_b, last_b, &result);
+            TRACE_END(computing);
+
+            TRACE_SPAN(formatting, "format");
+            if (defined)
+                sprintf(response, "%.4f", result);
+        }
+    }
+    else if (strcmp(args[0], "Append") == 0 && args[1] != NULL)
+    {
+        strcpy(response, appendBars(stocks, args, client_command));
+    }
+    else if (strcmp(args[0], "Subscribe") == 0 && args[1] != NULL)
+    {
+        strcpy(response, subscribeClient(stocks, args));
+    }
+    else // Client should be responsible for making sure queries are valid before being sent but this is here just in case
+    {
+        char* temp = malloc(24 * sizeof(char));
+        strcpy(temp, "Invalid syntax");
+        return temp;
+    }
+
+    return response;
+}
+
+char** split(char* inputStr)
+{
+    char** splitVals = NULL;
+    char* str = malloc(sizeof(char));
+    str[0] = '\0';
+
+    int count = 0, bigCount = 0;
+    
+    for (int i = 0; i < strlen(inputStr); i++)
+    {
+        if (inputStr[i] != ' ' && inputStr[i] != 9)
+        {
+            count++;
+            str = realloc(str, (count + 1) * sizeof(char));
+            str[count - 1] = inputStr[i];
+            str[count] = '\0';
+
+            if (i == strlen(inputStr) - 1)
+            {
+                bigCount++;
+                splitVals = realloc(splitVals, bigCount * sizeof(char*));
+                splitVals[bigCount - 1] = str;
+            }
+
+            continue;
+        }
+
+        // We don't want empty strings to be part of our array of strings
+        if (strlen(str) == 0)
+            continue;
+        
+        bigCount++;
+        splitVals = realloc(splitVals, bigCount * sizeof(char*));
+        splitVals[bigCount - 1] = str;
+
+        str = malloc(sizeof(char));
+        str[0] = '\0';
+        
+        count = 0;
+    }
+
+    // Add a terminating NULL value to the end of the data structure to signify that the end has been reached
+    splitVals = realloc(splitVals, (bigCount + 1) * sizeof(char*));
+    splitVals[bigCount] = NULL;
+
+    return splitVals;
+}
+
+// Reads one whole file on the calling thread, startup goes through loadStocks instead
+Stock* read_stock_data(char* filename) 
+{
+    LoadChunk chunk = {filename, 0, -1};
+    loadChunk(&chunk);
+
+    int skipped;
+    Stock* stock = joinChunks(filename, &chunk, 1, &skipped);
+    if (skipped > 0)
+        printf("Skipped %d out of order dates in %s\n", skipped, filename);
+
+    return stock;
+}
+
+// Parses the lines that start in [start, end) of a file, end -1 meaning up to the end of it. A chunk that starts
+// mid line leaves that line to the chunk before it.
+void loadChunk(LoadChunk* chunk)
+{
+    double began = monotonicSeconds();
+
+    FILE* file = fopen(chunk->filename, "r");
+    chunk->opened = file != NULL;
+    if (file == NULL)
+        return;
+
+    if (chunk->start > 0)
+    {
+        fseeko(file, chunk->start - 1, SEEK_SET);
+        int c = fgetc(file);
+        while (c != '\n' && c != EOF)
+            c = fgetc(file);
+    }
+
+    char line[1024];
+    int capacity = 1024;
+    int* days = malloc(capacity * sizeof(int));
+    double* closes = malloc(capacity * sizeof(double));
+    int count = 0;
+
+    while ((chunk->end < 0 || ftello(file) < chunk->end) && fgets(line, 1024, file)) 
+    {
+        int day;
+        double close;
+        if (!parseStockLine(line, &day, &close))
+            continue;
+
+        // buildCalendar and joinChunks both need the days in ascending order
+        if (count > 0 && day <= days[count - 1])
+        {
+            chunk->skipped++;
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            days = realloc(days, capacity * sizeof(int));
+            closes = realloc(closes, capacity * sizeof(double));
+        }
+
+        days[count] = day;
+        closes[count] = close;
+        count++;
+    }
+
+    fclose(file);
+
+    chunk->days = days;
+    chunk->closes = closes;
+    chunk->count = count;
+    chunk->seconds = monotonicSeconds() - began;
+}
+
+// Pulls the date and closing price out of a csv line. The header (and anything else without a real date) fails.
+bool parseStockLine(char* line, int* day, double* close)
+{
+    char* rest;
+    char* tok;
+    int i = 0;
+
+    *day = -1;
+    for (tok = strtok_r(line, ",", &rest); tok && *tok; tok = strtok_r(NULL, ",\n", &rest)) 
+    {
+        if (i == 0) 
+            *day = parseDay(tok);
+        else if (i == 4 && *day != -1) 
+        {
+            *close = atof(tok);
+            return true;
+        }
+        i++;
+    }
+
+    return false;
+}
+
+// Puts the chunks of one file back together in order. Each chunk only knew about its own rows, so a row that is
+// out of order with an earlier chunk is dropped here. skipped counts the rows dropped along the way.
+Stock* joinChunks(char* filename, LoadChunk* chunks, int chunk_count, int* skipped)
+{
+    *skipped = 0;
+    for (int c = 0; c < chunk_count; c++)
+        *skipped += chunks[c].skipped;
+
+    if (!chunks[0].opened)
+    {
+        printf("Could not open file %s\n", filename);
+        return NULL;
+    }
+
+    int total = 0;
+    for (int c = 0; c < chunk_count; c++)
+        total += chunks[c].count;
+
+    int* days = realloc(chunks[0].days, (total + 1) * sizeof(int));
+    double* closes = realloc(chunks[0].closes, (total + 1) * sizeof(double));
+    int count = chunks[0].count;
+
+    for (int c = 1; c < chunk_count; c++)
+    {
+        for (int r = 0; r < chunks[c].count; r++)
+        {
+            if (count > 0 && chunks[c].days[r] <= days[count - 1])
+            {
+                (*skipped)++;
+                continue;
+            }
+
+            days[count] = chunks[c].days[r];
+            closes[count] = chunks[c].closes[r];
+            count++;
+        }
+
+        free(chunks[c].days);
+        free(chunks[c].closes);
+    }
+
+    Stock* stock = malloc(sizeof(Stock));
+    stock->size = count;
+    stock->capacity = total + 1;
+    stock->days = days;
+    stock->closes = closes;
+    stock->packed = NULL;
+    stock->calendar = NULL;
+    stock->name = get_csv_stock_name(filename);
+
+    return stock;
+}
+
+// Loads every csv file on a pool of threads, one per core. First every chunk of every file is parsed, then each
+// file is joined, gets its calendar and is packed. The stocks are only added to the list at the end, in the order
+// the files were given, so List comes out the same however the threads were scheduled.
+void loadStocks(StockList* stocks, char** files, int file_count, bool compress)
+{
+    double began = monotonicSeconds();
+
+    LoadJob job;
+    job.files = files;
+    job.file_count = file_count;
+    job.compress = compress;
+    job.loaded = calloc(file_count, sizeof(Stock*));
+    job.first_chunk = malloc((file_count + 1) * sizeof(int));
+    job.finished = 0;
+
+    // Cut big files up at (roughly) every LOAD_CHUNK_BYTES, the chunks find their own line boundaries
+    int chunk_count = 0;
+    int chunk_capacity = file_count;
+    job.chunks = malloc(chunk_capacity * sizeof(LoadChunk));
+
+    for (int f = 0; f < file_count; f++)
+    {
+        struct stat info;
+        off_t size = stat(files[f], &info) == 0 ? info.st_size : 0;
+        int pieces = size / LOAD_CHUNK_BYTES + 1;
+
+        job.first_chunk[f] = chunk_count;
+        for (int p = 0; p < pieces; p++)
+        {
+            if (chunk_count == chunk_capacity)
+            {
+                chunk_capacity *= 2;
+                job.chunks = realloc(job.chunks, chunk_capacity * sizeof(LoadChunk));
+            }
+
+            LoadChunk* chunk = &job.chunks[chunk_count++];
+            memset(chunk, 0, sizeof(LoadChunk));
+            chunk->filename = files[f];
+            chunk->start = size * p / pieces;
+            chunk->end = p == pieces - 1 ? -1 : size * (p + 1) / pieces;
+        }
+    }
+    job.first_chunk[file_count] = chunk_count;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    job.threads = cores > 0 ? cores : 1;
+    if (job.threads > chunk_count)
+        job.threads = chunk_count;
+
+    runLoadPhase(&job, LOAD_PARSE, chunk_count);
+    runLoadPhase(&job, LOAD_FINISH, file_count);
+
+    long rows = 0;
+    int loaded = 0;
+    for (int f = 0; f < file_count; f++)
+    {
+        if (job.loaded[f] == NULL)
+            continue;
+
+        append_stock(stocks, job.loaded[f]);
+        rows += job.loaded[f] -> size;
+        loaded++;
+    }
+
+    printf("Loaded %d of %d files (%ld rows, %d chunks) in %.1f ms on %d threads\n", loaded, file_count, rows,
+        chunk_count, (monotonicSeconds() - began) * 1000, job.threads);
+
+    free(job.loaded);
+    free(job.first_chunk);
+    free(job.chunks);
+}
+
+void runLoadPhase(LoadJob* job, LoadPhase phase, int tasks)
+{
+    job->phase = phase;
+    job->tasks = tasks;
+    job->next = 0;
+
+    pthread_t* threads = malloc(job->threads * sizeof(pthread_t));
+    for (int t = 0; t < job->threads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, runLoader, job) != 0)
+        {
+            perror("Error: Unable to start loader thread");
+            exit(1);
+        }
+    }
+
+    for (int t = 0; t < job->threads; t++)
+        pthread_join(threads[t], NULL);
+
+    free(threads);
+}
+
+void* runLoader(void* arg)
+{
+    LoadJob* job = arg;
+
+    int task;
+    while ((task = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->tasks)
+    {
+        if (job->phase == LOAD_PARSE)
+        {
+            loadChunk(&job->chunks[task]);
+            continue;
+        }
+
+        double began = monotonicSeconds();
+        LoadChunk* chunks = &job->chunks[job->first_chunk[task]];
+        int chunk_count = job->first_chunk[task + 1] - job->first_chunk[task];
+
+        double parsing = 0;
+        for (int c = 0; c < chunk_count; c++)
+            parsing += chunks[c].seconds;
+
+        int skipped;
+        Stock* stock = joinChunks(job->files[task], chunks, chunk_count, &skipped);
+        if (stock != NULL)
+        {
+            buildCalendar(stock, job->compress);
+            if (job->compress)
+                packStock(stock);
+        }
+        job->loaded[task] = stock;
+
+        int finished = __atomic_add_fetch(&job->finished, 1, __ATOMIC_RELAXED);
+        if (stock != NULL && skipped > 0)
+            printf("[%d/%d] %s: %d rows (%d out of order dates skipped) in %.2f ms\n", finished, job->file_count,
+                job->files[task], stock -> size, skipped, (parsing + monotonicSeconds() - began) * 1000);
+        else if (stock != NULL)
+            printf("[%d/%d] %s: %d rows in %.2f ms\n", finished, job->file_count, job->files[task], stock -> size,
+                (parsing + monotonicSeconds() - began) * 1000);
+    }
+
+    return NULL;
+}
+
+double monotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int endsWith(const char *str, const char *suffix) 
+{
+    if (!str || !suffix)
+        return 0;
+
+    size_t lenstr = strlen(str);
+    size_t lensuffix = strlen(suffix);
+
+    if (lensuffix > lenstr)
+        return 0;
+
+    return strncmp(str + lenstr - lensuffix, suffix, lensuffix) == 0;
+}
+
+StockList* init_stock_list() 
+{
+    StockList* stock_list = malloc(sizeof(StockList));
+    stock_list->stocks = malloc(sizeof(Stock*));
+    stock_list->size = 0;
+    return stock_list;
+}
+
+void append_stock(StockList* stock_list, Stock* stock) 
+{
+    stock_list->stocks = realloc(stock_list->stocks, (stock_list->size + 2) * sizeof(Stock*));
+    stock_list->stocks[stock_list->size] = stock;
+    stock_list->stocks[stock_list->size + 1] = NULL;
+    stock_list->size++;
+}
+
+char* get_csv_stock_name(const char *filename) 
+{
+    // Files loaded from another directory are still named after the ticker alone
+    const char *slash = strrchr(filename, '/');
+    if (slash)
+        filename = slash + 1;
+
+    const char *dot = strrchr(filename, '.');
+
+    if (!dot || dot == filename) 
+        return "";
+
+    return strndup(filename, dot - filename);
+}
+
+char* getStockName(Stock* stock)
+{
+    return stock -> name;
+}
+
+// Finds the row holding the given day, or -1 if the stock didn't trade that day
+int getIndex(Stock* stock, int day)
+{
+    Calendar* calendar = __atomic_load_n(&stock -> calendar, __ATOMIC_ACQUIRE);
+
+    if (day == -1 || calendar == NULL)
+        return -1;
+
+    // Append publishes the length last, so every day before it (and the row it points at) is already in place
+    int offset = day - calendar->first_day;
+    if (offset < 0 || offset >= __atomic_load_n(&calendar->length, __ATOMIC_ACQUIRE))
+        return -1;
+
+    int* rows = __atomic_load_n(&calendar->rows, __ATOMIC_ACQUIRE);
+    if (rows != NULL)
+        return rows[offset];
+
+    uint64_t word = __atomic_load_n(&__atomic_load_n(&calendar->bits, __ATOMIC_ACQUIRE)[offset / 64], __ATOMIC_RELAXED);
+    uint64_t bit = 1ULL << (offset % 64);
+
+    if (!(word & bit))
+        return -1;
+
+    return __atomic_load_n(&calendar->ranks, __ATOMIC_ACQUIRE)[offset / 64] + __builtin_popcountll(word & (bit - 1));
+}
+
+void buildCalendar(Stock* stock, bool compact)
+{
+    if (stock -> size == 0)
+        return;
+
+    Calendar* calendar = malloc(sizeof(Calendar));
+    calendar->first_day = stock -> days[0];
+    calendar->length = stock -> days[stock -> size - 1] - calendar->first_day + 1;
+    calendar->capacity = calendar->length;
+    calendar->rows = NULL;
+    calendar->bits = NULL;
+    calendar->ranks = NULL;
+
+    if (!compact)
+    {
+        calendar->rows = malloc(calendar->length * sizeof(int));
+        for (int i = 0; i < calendar->length; i++)
+            calendar->rows[i] = -1;
+
+        for (int row = 0; row < stock -> size; row++)
+            calendar->rows[stock -> days[row] - calendar->first_day] = row;
+    }
+    else
+    {
+        int words = (calendar->length + 63) / 64;
+        calendar->capacity = words * 64;
+        calendar->bits = calloc(words, sizeof(uint64_t));
+        calendar->ranks = malloc(words * sizeof(uint32_t));
+
+        for (int row = 0; row < stock -> size; row++)
+        {
+            int offset = stock -> days[row] - calendar->first_day;
+            calendar->bits[offset / 64] |= 1ULL << (offset % 64);
+        }
+
+        uint32_t before = 0;
+        for (int w = 0; w < words; w++)
+        {
+            calendar->ranks[w] = before;
+            before += __builtin_popcountll(calendar->bits[w]);
+        }
+    }
+
+    stock -> calendar = calendar;
+}
+
+double closeAt(Stock* stock, int row)
+{
+    if (stock -> packed == NULL)
+        return liveCloses(stock)[row];
+
+    if (row >= stock -> packed -> rows)
+        return liveCloses(stock)[row - stock -> packed -> rows];
+
+    int days[PACK_BLOCK_ROWS];
+    int64_t prices[PACK_BLOCK_ROWS];
+
+    unpackBlock(stock -> packed, row / PACK_BLOCK_ROWS, days, prices);
+
+    return (double)prices[row % PACK_BLOCK_ROWS] / PACK_PRICE_SCALE;
+}
+
+// The trading day of a row, closeAt() for dates
+int dayAt(Stock* stock, int row)
+{
+    int* days = __atomic_load_n(&stock -> days, __ATOMIC_ACQUIRE);
+
+    if (stock -> packed == NULL)
+        return days[row];
+
+    if (row >= stock -> packed -> rows)
+        return days[row - stock -> packed -> rows];
+
+    int packedDays[PACK_BLOCK_ROWS];
+    int64_t prices[PACK_BLOCK_ROWS];
+
+    unpackBlock(stock -> packed, row / PACK_BLOCK_ROWS, packedDays, prices);
+
+    return packedDays[row % PACK_BLOCK_ROWS];
+}
+
+char* roundUp(char* str) 
+{
+   float num = atof(str);
+   float rounded = (num * 100) / 100;
+
+   char* result = malloc(10 * sizeof(char));
+   sprintf(result, "%.2f", rounded);
+
+   return result;
+}
+
+
+bool validDate(char* date) 
+{
+    int year, month, day, length = 0;
+
+    // Only the exact YYYY-MM-DD form, "2021-11-5" or "2021-11-05junk" must not end up as a day we have
+    for (int i = 0; i < 10; i++)
+    {
+        if (i == 4 || i == 7 ? date[i] != '-' : date[i] < '0' || date[i] > '9')
+            return false;
+    }
+
+    if (sscanf(date, "%d-%d-%d%n", &year, &month, &day, &length) != 3 || length != 10 || date[10] != '\0')
+        return false;
+
+    if (year < 1800 || year > 9999) 
+        return false;
+    
+    if (month < 1 || month > 12) 
+        return false;
+
+    if (day < 1 || day > 31) 
+        return false;
+
+    // February
+    if (month == 2) 
+    {
+        if (year % 400 == 0 || (year % 100 != 0 && year % 4 == 0)) 
+        {
+            if (day > 29) 
+            {
+                return false;
+            }
+        } 
+        else 
+        {
+            if (day > 28) 
+            {
+                return false;
+            }
+        }
+    } 
+    else if (month == 4 || month == 6 || month == 9 || month == 11) 
+    {
+        if (day > 30) 
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Turns a YYYY-MM-DD date into a day number, or -1 if it isn't a valid date. Days are counted from 0000-03-01
+// so every date validDate() accepts is positive and consecutive calendar days are consecutive numbers.
+int parseDay(char* date)
+{
+    int year, month, day;
+
+    if (!validDate(date) || sscanf(date, "%d-%d-%d", &year, &month, &day) != 3)
+        return -1;
+
+    // Treat January and February as the end of the previous year so the leap day is always last
+    if (month <= 2)
+        year--;
+
+    int era = year / 400;
+    int year_of_era = year - era * 400;
+    int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return era * 146097 + day_of_era;
+}
+
+// The inverse of parseDay(), writes the day out as YYYY-MM-DD (out needs room for 11 characters)
+void formatDay(int day, char* out)
+{
+    int era = day / 146097;
+    int day_of_era = day - era * 146097;
+    int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int shifted_month = (5 * day_of_year + 2) / 153;
+
+    int dayOfMonth = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    int month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    int year = year_of_era + era * 400 + (month <= 2);
+
+    sprintf(out, "%04d-%02d-%02d", year, month, dayOfMonth);
+}
+
+float calculateMaxProfit(double* prices, int size) 
+{
+    // Should never occur but here just in case since I don't want to risk a seg fault
+    if (size < 2)
+        return 0;
+    
+    float minPrice = (float)prices[0];
+    float maxProfit = (float)prices[1] - (float)prices[0];
+
+    for (int i = 1; i < size; i++) 
+    {
+        float currentPrice = (float)prices[i];
+
+        // Calculate profit if we bought at min price and sold at current price
+        float potentialProfit = currentPrice - minPrice;
+
+        if (potentialProfit > maxProfit)
+            maxProfit = potentialProfit;
+
+        if (currentPrice < minPrice)
+            minPrice = currentPrice;
+    }
+
+    if (maxProfit < 0)
+        maxProfit = 0;
+
+    return maxProfit;
+}
+
+// True if both the start and end dates are trading days with at least two days in the range (inclusive).
+// The matching rows are handed back through first and last.
+bool validBorderDates(Stock* stock, int start, int end, int* first, int* last)
+{
+    *first = getIndex(stock, start);
+    *last = getIndex(stock, end);
+
+    if (*first == -1 || *last == -1 || *last <= *first)
+        return false;
+    
+    return true;
+}
+
+size_t writeVarint(unsigned char* out, int64_t value)
+{
+    // Zigzag so small negative deltas stay small
+    uint64_t bits = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    size_t length = 0;
+
+    while (bits >= 0x80)
+    {
+        out[length++] = (unsigned char)(bits | 0x80);
+        bits >>= 7;
+    }
+    out[length++] = (unsigned char)bits;
+
+    return length;
+}
+
+size_t readVarint(unsigned char* in, int64_t* value)
+{
+    uint64_t bits = 0;
+    size_t length = 0;
+    int shift = 0;
+
+    do
+    {
+        bits |= (uint64_t)(in[length] & 0x7f) << shift;
+        shift += 7;
+    } while (in[length++] & 0x80);
+
+    *value = (int64_t)(bits >> 1) ^ -(int64_t)(bits & 1);
+
+    return length;
+}
+
+// Replaces the plain columns of a stock with the compressed block format
+void packStock(Stock* stock)
+{
+    PackedColumn* packed = malloc(sizeof(PackedColumn));
+    packed->block_count = (stock -> size + PACK_BLOCK_ROWS - 1) / PACK_BLOCK_ROWS;
+    packed->blocks = malloc((packed->block_count + 1) * sizeof(PackedBlock));
+
+    // Worst case is a full 5 byte varint for every day and a 10 byte one for every price
+    packed->bytes = malloc(stock -> size * 15 + 1);
+    size_t used = 0;
+
+    for (int b = 0; b < packed->block_count; b++)
+    {
+        PackedBlock* block = &packed->blocks[b];
+        int first = b * PACK_BLOCK_ROWS;
+        int last = first + PACK_BLOCK_ROWS < stock -> size ? first + PACK_BLOCK_ROWS : stock -> size;
+
+        block->offset = (uint32_t)used;
+        block->count = last - first;
+        block->first_day = stock -> days[first];
+        block->last_day = stock -> days[last - 1];
+
+        int previous_delta = 0;
+        int64_t previous_price = 0;
+
+        for (int row = first; row < last; row++)
+        {
+            int64_t price = llround(stock -> closes[row] * PACK_PRICE_SCALE);
+
+            if (row == first || price < block->min_price)
+                block->min_price = price;
+            if (row == first || price > block->max_price)
+                block->max_price = price;
+
+            // The first day is already in the block summary
+            if (row > first)
+            {
+                int delta = stock -> days[row] - stock -> days[row - 1];
+                used += writeVarint(packed->bytes + used, delta - previous_delta);
+                previous_delta = delta;
+            }
+
+            used += writeVarint(packed->bytes + used, price - previous_price);
+            previous_price = price;
+        }
+    }
+
+    packed->byte_count = used;
+    packed->bytes = realloc(packed->bytes, used + 1);
+
+    packed->rows = stock -> size;
+
+    free(stock -> days);
+    free(stock -> closes);
+    stock -> days = NULL;
+    stock -> closes = NULL;
+    stock -> capacity = 0;
+    stock -> packed = packed;
+}
+
+// Decodes one block into days and fixed point prices (both at least PACK_BLOCK_ROWS long) and returns its row count
+int unpackBlock(PackedColumn* packed, int block, int* days, int64_t* prices)
+{
+    PackedBlock* summary = &packed->blocks[block];
+    unsigned char* in = packed->bytes + summary->offset;
+
+    int64_t delta_of_delta, price_delta;
+    int delta = 0;
+    int64_t price = 0;
+
+    for (int i = 0; i < summary->count; i++)
+    {
+        if (i == 0)
+            days[i] = summary->first_day;
+        else
+        {
+            in += readVarint(in, &delta_of_delta);
+            delta += (int)delta_of_delta;
+            days[i] = days[i - 1] + delta;
+        }
+
+        in += readVarint(in, &price_delta);
+        price += price_delta;
+        prices[i] = price;
+    }
+
+    return summary->count;
+}
+
+
+// Same answer as calculateMaxProfit() over rows first..last, but straight off the compressed blocks (and then
+// whatever Append has added after them)
+float packedMaxProfit(Stock* stock, int first, int last)
+{
+    PackedColumn* packed = stock -> packed;
+    int days[PACK_BLOCK_ROWS];
+    int64_t prices[PACK_BLOCK_ROWS];
+
+    int64_t minPrice = INT64_MAX;
+    int64_t maxProfit = 0;
+
+    int lastPacked = last < packed->rows ? last : packed->rows - 1;
+
+    for (int b = first / PACK_BLOCK_ROWS; first < packed->rows && b <= lastPacked / PACK_BLOCK_ROWS; b++)
+    {
+        PackedBlock* block = &packed->blocks[b];
+        int from = b * PACK_BLOCK_ROWS;
+        int to = from + block->count - 1;
+
+        // A block that can neither lower the running minimum nor beat the best profit doesn't need decoding
+        if (from >= first && to <= last && block->min_price >= minPrice && block->max_price - minPrice <= maxProfit)
+            continue;
+
+        unpackBlock(packed, b, days, prices);
+
+        for (int row = from > first ? from : first; row <= to && row <= last; row++)
+        {
+            int64_t currentPrice = prices[row - from];
+
+            if (currentPrice - minPrice > maxProfit)
+                maxProfit = currentPrice - minPrice;
+
+            if (currentPrice < minPrice)
+                minPrice = currentPrice;
+        }
+    }
+
+    // Appended rows aren't packed, but are compared at the same fixed point scale
+    double* tail = liveCloses(stock);
+    for (int row = first > packed->rows ? first : packed->rows; row <= last; row++)
+    {
+        int64_t currentPrice = llround(tail[row - packed->rows] * PACK_PRICE_SCALE);
+
+        if (currentPrice - minPrice > maxProfit)
+            maxProfit = currentPrice - minPrice;
+
+        if (currentPrice < minPrice)
+            minPrice = currentPrice;
+    }
+
+    return (float)maxProfit / PACK_PRICE_SCALE;
+}
+
+Stock* findStock(StockList* stocks, char* name)
+{
+    for (int i = 0; stocks -> stocks[i] != NULL; i++)
+    {
+        if (strcmp(getStockName(stocks -> stocks[i]), name) == 0)
+            return stocks -> stocks[i];
+    }
+
+    return NULL;
+}
+
+// Closing prices for rows first..last as one contiguous array. Plain stocks hand back their own column, packed
+// ones are decoded into a fresh array which the caller has to free (owned is set when that happens).
+double* getCloses(Stock* stock, int first, int last, bool* owned)
+{
+    if (stock -> packed == NULL)
+    {
+        *owned = false;
+        return liveCloses(stock) + first;
+    }
+
+    int days[PACK_BLOCK_ROWS];
+    int64_t prices[PACK_BLOCK_ROWS];
+    double* closes = malloc((last - first + 1) * sizeof(double));
+    int packedRows = stock -> packed -> rows;
+
+    for (int b = first / PACK_BLOCK_ROWS; first < packedRows && b <= (last < packedRows ? last : packedRows - 1) / PACK_BLOCK_ROWS; b++)
+    {
+        int from = b * PACK_BLOCK_ROWS;
+        int count = unpackBlock(stock -> packed, b, days, prices);
+
+        for (int row = from > first ? from : first; row < from + count && row <= last; row++)
+            closes[row - first] = (double)prices[row - from] / PACK_PRICE_SCALE;
+    }
+
+    double* tail = liveCloses(stock);
+    for (int row = first > packedRows ? first : packedRows; row <= last; row++)
+        closes[row - first] = tail[row - packedRows];
+
+    *owned = true;
+    return closes;
+}
+
+// Trading days for rows first..last, the getCloses() of days
+int* getDays(Stock* stock, int first, int last, bool* owned)
+{
+    int* tail = __atomic_load_n(&stock -> days, __ATOMIC_ACQUIRE);
+
+    if (stock -> packed == NULL)
+    {
+        *owned = false;
+        return tail + first;
+    }
+
+    int days[PACK_BLOCK_ROWS];
+    int64_t prices[PACK_BLOCK_ROWS];
+    int* result = malloc((last - first + 1) * sizeof(int));
+    int packedRows = stock -> packed -> rows;
+
+    for (int b = first / PACK_BLOCK_ROWS; first < packedRows && b <= (last < packedRows ? last : packedRows - 1) / PACK_BLOCK_ROWS; b++)
+    {
+        int from = b * PACK_BLOCK_ROWS;
+        int count = unpackBlock(stock -> packed, b, days, prices);
+
+        for (int row = from > first ? from : first; row < from + count && row <= last; row++)
+            result[row - first] = days[row - from];
+    }
+
+    for (int row = first > packedRows ? first : packedRows; row <= last; row++)
+        result[row - first] = tail[row - packedRows];
+
+    *owned = true;
+    return result;
+}
+
+// A column the vector kernels can load straight from, rounded up to whole vectors
+double* alignedColumn(int size)
+{
+    size_t bytes = ((size * sizeof(double) + VECTOR_BYTES - 1) / VECTOR_BYTES) * VECTOR_BYTES;
+    return aligned_alloc(VECTOR_BYTES, bytes > 0 ? bytes : VECTOR_BYTES);
+}
+
+// Daily log returns of size closes, size - 1 of them. returns may be closes itself.
+int logReturns(double* closes, int size, double* returns)
+{
+    for (int i = 0; i + 1 < size; i++)
+        returns[i] = log(closes[i + 1] / closes[i]);
+
+    return size > 0 ? size - 1 : 0;
+}
+
+double sumVector(const double* x, int size)
+{
+    DoubleVector total = {0};
+    int i = 0;
+
+    for (; i + VECTOR_LANES <= size; i += VECTOR_LANES)
+        total += *(const DoubleVector*)(x + i);
+
+    double sum = 0;
+    for (int lane = 0; lane < VECTOR_LANES; lane++)
+        sum += total[lane];
+    for (; i < size; i++)
+        sum += x[i];
+
+    return sum;
+}
+
+// Sum of squared deviations from mean, the column aligned
+double squaredDeviations(const double* x, int size, double mean)
+{
+    DoubleVector m = {0};
+    DoubleVector total = {0};
+    m += mean;
+
+    int i = 0;
+    for (; i + VECTOR_LANES <= size; i += VECTOR_LANES)
+    {
+        DoubleVector d = *(const DoubleVector*)(x + i) - m;
+        total += d * d;
+    }
+
+    double sum = 0;
+    for (int lane = 0; lane < VECTOR_LANES; lane++)
+        sum += total[lane];
+    for (; i < size; i++)
+        sum += (x[i] - mean) * (x[i] - mean);
+
+    return sum;
+}
+
+// Sums of squared and cross deviations from the given means, both columns aligned
+void centeredSums(const double* x, const double* y, int size, double mean_x, double mean_y, double* sxx, double* syy, double* sxy)
+{
+    DoubleVector mx = {0}, my = {0};
+    DoubleVector vxx = {0}, vyy = {0}, vxy = {0};
+    mx += mean_x;
+    my += mean_y;
+
+    int i = 0;
+    for (; i + VECTOR_LANES <= size; i += VECTOR_LANES)
+    {
+        DoubleVector dx = *(const DoubleVector*)(x + i) - mx;
+        DoubleVector dy = *(const DoubleVector*)(y + i) - my;
+        vxx += dx * dx;
+        vyy += dy * dy;
+        vxy += dx * dy;
+    }
+
+    *sxx = *syy = *sxy = 0;
+    for (int lane = 0; lane < VECTOR_LANES; lane++)
+    {
+        *sxx += vxx[lane];
+        *syy += vyy[lane];
+        *sxy += vxy[lane];
+    }
+
+    for (; i < size; i++)
+    {
+        double dx = x[i] - mean_x;
+        double dy = y[i] - mean_y;
+        *sxx += dx * dx;
+        *syy += dy * dy;
+        *sxy += dx * dy;
+    }
+}
+
+// Log returns and drawdowns are meaningless once a close is zero or below (Append takes a close of 0)
+bool positiveCloses(double* closes, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (!(closes[i] > 0))
+            return false;
+    }
+
+    return true;
+}
+
+// Annualised standard deviation of the daily log returns, in percent. Needs at least two returns and prices above
+// zero.
+bool volatility(double* closes, int size, double* result)
+{
+    if (!positiveCloses(closes, size))
+        return false;
+
+    double* returns = alignedColumn(size);
+    int count = logReturns(closes, size, returns);
+
+    if (count < 2)
+    {
+        free(returns);
+        return false;
+    }
+
+    double sxx = squaredDeviations(returns, count, sumVector(returns, count) / count);
+    free(returns);
+
+    *result = sqrt(sxx / (count - 1) * TRADING_DAYS_PER_YEAR) * 100;
+    return true;
+}
+
+// Largest fall from a previous high, in percent of that high. The running high carries from one day to the next
+// so this one stays a plain loop. Needs prices above zero.
+bool maxDrawdown(double* closes, int size, double* result)
+{
+    if (!positiveCloses(closes, size))
+        return false;
+
+    double peak = closes[0];
+    double worst = 0;
+
+    for (int i = 1; i < size; i++)
+    {
+        if (closes[i] > peak)
+            peak = closes[i];
+
+        double drawdown = (peak - closes[i]) / peak;
+        if (drawdown > worst)
+            worst = drawdown;
+    }
+
+    *result = worst * 100;
+    return true;
+}
+
+// Pearson correlation of the daily log returns of two stocks over the days both of them traded. The two day
+// columns are merged to line the closes up, gaps in either one just make for a longer return on both sides.
+bool correlation(Stock* a, int first_a, int last_a, Stock* b, int first_b, int last_b, double* result)
+{
+    bool owned_days_a, owned_days_b, owned_a, owned_b;
+    int* days_a = getDays(a, first_a, last_a, &owned_days_a);
+    int* days_b = getDays(b, first_b, last_b, &owned_days_b);
+    double* closes_a = getCloses(a, first_a, last_a, &owned_a);
+    double* closes_b = getCloses(b, first_b, last_b, &owned_b);
+    int size_a = last_a - first_a + 1;
+    int size_b = last_b - first_b + 1;
+
+    double* x = alignedColumn(size_a < size_b ? size_a : size_b);
+    double* y = alignedColumn(size_a < size_b ? size_a : size_b);
+    int count = 0;
+
+    for (int i = 0, j = 0; i < size_a && j < size_b; )
+    {
+        if (days_a[i] < days_b[j])
+            i++;
+        else if (days_a[i] > days_b[j])
+            j++;
+        else
+        {
+            x[count] = closes_a[i++];
+            y[count] = closes_b[j++];
+            count++;
+        }
+    }
+
+    if (owned_days_a)
+        free(days_a);
+    if (owned_days_b)
+        free(days_b);
+    if (owned_a)
+        free(closes_a);
+    if (owned_b)
+        free(closes_b);
+
+    // Only the days both traded on go into the returns, so those are the closes that have to be above zero
+    bool positive = positiveCloses(x, count) && positiveCloses(y, count);
+
+    logReturns(x, count, x);
+    count = logReturns(y, count, y);
+
+    bool defined = false;
+    if (positive && count >= 2)
+    {
+        double sxx, syy, sxy;
+        centeredSums(x, y, count, sumVector(x, count) / count, sumVector(y, count) / count, &sxx, &syy, &sxy);
+
+        defined = sxx > 0 && syy > 0;
+        if (defined)
+            *result = sxy / sqrt(sxx * syy);
+    }
+
+    free(x);
+    free(y);
+    return defined;
+}
+
+// Best total profit from at most k buy/sell pairs, paying fee on every sale and waiting cooldown days after a sale
+// before buying again. Runs in O(size * k) and only keeps the last cooldown + 1 days of state (never more than
+// size, a longer cooldown gives the same answer). Returns NAN if that state can't be allocated.
+double maxProfitK(double* prices, int size, int k, double fee, int cooldown)
+{
+    // holding[j] is the best we can do while holding the j-th position, sold[j] after closing j positions.
+    // A buy today has to come from the sold state as it was cooldown + 1 days ago, hence the ring of past rows.
+    int lag = cooldown < size ? cooldown + 1 : size;
+    double* holding = malloc(((size_t)k + 1) * sizeof(double));
+    double* sold = calloc((size_t)lag * ((size_t)k + 1), sizeof(double));
+
+    if (holding == NULL || sold == NULL)
+    {
+        free(holding);
+        free(sold);
+        return NAN;
+    }
+
+    for (int j = 0; j <= k; j++)
+        holding[j] = -INFINITY;
+
+    for (int i = 0; i < size; i++)
+    {
+        // Yesterday's row (the one we update into) and the row from cooldown + 1 days ago
+        double* today = sold + (size_t)(i % lag) * (k + 1);
+        double* previous = sold + (size_t)((i + lag - 1) % lag) * (k + 1);
+        double* before_cooldown = today;
+
+        for (int j = k; j >= 1; j--)
+        {
+            double buy = before_cooldown[j - 1] - prices[i];
+            double sell = holding[j] + prices[i] - fee;
+
+            if (buy > holding[j])
+                holding[j] = buy;
+
+            today[j] = previous[j] > sell ? previous[j] : sell;
+        }
+    }
+
+    double best = 0;
+    double* final_row = sold + (size_t)((size - 1) % lag) * (k + 1);
+    for (int j = 1; j <= k; j++)
+    {
+        if (final_row[j] > best)
+            best = final_row[j];
+    }
+
+    free(holding);
+    free(sold);
+
+    return best;
+}
+
+// Same question as maxProfitK() once k stops mattering. Without a fee or cooldown every rise can be taken, otherwise
+// it is the same recurrence with a single position.
+double maxProfitUnlimited(double* prices, int size, double fee, int cooldown)
+{
+    double profit = 0;
+
+    if (fee == 0 && cooldown == 0)
+    {
+        for (int i = 1; i < size; i++)
+        {
+            if (prices[i] > prices[i - 1])
+                profit += prices[i] - prices[i - 1];
+        }
+
+        return profit;
+    }
+
+    int lag = cooldown < size ? cooldown + 1 : size;
+    double* sold = calloc(lag, sizeof(double));
+    double holding = -INFINITY;
+
+    if (sold == NULL)
+        return NAN;
+
+    for (int i = 0; i < size; i++)
+    {
+        double previous = sold[(i + lag - 1) % lag];
+        double buy = sold[i % lag] - prices[i];
+        double sell = holding + prices[i] - fee;
+
+        if (buy > holding)
+            holding = buy;
+
+        sold[i % lag] = previous > sell ? previous : sell;
+    }
+
+    profit = sold[(size - 1) % lag];
+    free(sold);
+
+    return profit;
+}
+
+// The plain closes column. Append swaps in a bigger array when it runs out of room, so always go through here.
+double* liveCloses(Stock* stock)
+{
+    return __atomic_load_n(&stock -> closes, __ATOMIC_ACQUIRE);
+}
+
+// Append TICKER date open high low close adjclose volume [date open ...]. Every bar is checked before any of them
+// is added, so a batch goes in whole or not at all. Only the close is kept, same as when loading the csv files.
+// request is the original command for the append log, NULL when replaying that log.
+char* appendBars(StockList* stocks, char** args, char* request)
+{
+    if (!appends_allowed)
+        return "Append is not available with --workers";
+
+    // Replaying the append log (request == NULL) is the server itself
+    if (request != NULL && !c_trusted)
+        return "Append needs a --unix or --shm connection from the server's own user";
+
+    int fields = 0;
+    while (args[2 + fields] != NULL)
+        fields++;
+
+    if (fields == 0 || fields % 7 != 0)
+        return "Invalid syntax";
+
+    int bars = fields / 7;
+    int* days = malloc(bars * sizeof(int));
+    double* closes = malloc(bars * sizeof(double));
+    char* result = NULL;
+
+    for (int b = 0; b < bars && result == NULL; b++)
+    {
+        char** bar = args + 2 + b * 7;
+        days[b] = parseDay(bar[0]);
+
+        for (int f = 1; f < 7 && result == NULL; f++)
+        {
+            char* end;
+            double value = strtod(bar[f], &end);
+
+            if (*end != '\0' || !isfinite(value) || value < 0)
+                result = "Invalid syntax";
+        }
+
+        closes[b] = atof(bar[4]);
+
+        if (days[b] == -1)
+            result = "Invalid syntax";
+        else if (result == NULL && b > 0 && days[b] <= days[b - 1])
+            result = "Out of order";
+    }
+
+    Stock* stock = result == NULL ? findStock(stocks, args[1]) : NULL;
+    if (result == NULL && stock == NULL)
+        result = "Unknown";
+
+    if (result == NULL)
+    {
+        pthread_mutex_lock(&append_lock);
+
+        Calendar* calendar = stock -> calendar;
+        if (calendar != NULL && days[0] < calendar->first_day + calendar->length)
+            result = "Out of order";
+
+        // Logged before it is applied, if we die in between the replay puts it in on the next start
+        if (result == NULL && append_log >= 0 && request != NULL)
+        {
+            char* line = malloc(strlen(request) + 2);
+            line[0] = '\0';
+
+            for (int i = 0; args[i] != NULL; i++)
+            {
+                if (i > 0)
+                    strcat(line, " ");
+                strcat(line, args[i]);
+            }
+            strcat(line, "\n");
+
+            if (write(append_log, line, strlen(line)) != (ssize_t)strlen(line))
+            {
+                perror("Error: Unable to write to append log");
+                result = "Unable to log append";
+            }
+
+            free(line);
+        }
+
+        if (result == NULL)
+        {
+            for (int b = 0; b < bars; b++)
+                appendRow(stock, days[b], closes[b]);
+
+            result = "OK";
+        }
+
+        pthread_mutex_unlock(&append_lock);
+
+        if (strcmp(result, "OK") == 0)
+            notifySubscribers();
+    }
+
+    free(days);
+    free(closes);
+
+    return result;
+}
+
+// Adds one bar after the last one, with append_lock held. Queries on other threads may be reading the stock the
+// whole time, so the row goes in first, then the calendar, and only then the length and size that expose it.
+// Arrays that fill up are replaced by copies twice the size and the old ones are never freed since a query could
+// still be using them. With doubling that wastes at most as much memory again as the appended rows take.
+void appendRow(Stock* stock, int day, double close)
+{
+    int row = stock -> size;
+    int slot = row - (stock -> packed != NULL ? stock -> packed -> rows : 0);
+
+    if (slot >= stock -> capacity)
+    {
+        int capacity = stock -> capacity < 64 ? 64 : stock -> capacity * 2;
+        int* days = malloc(capacity * sizeof(int));
+        double* closes = malloc(capacity * sizeof(double));
+
+        if (slot > 0)
+        {
+            memcpy(days, stock -> days, slot * sizeof(int));
+            memcpy(closes, stock -> closes, slot * sizeof(double));
+        }
+
+        __atomic_store_n(&stock -> days, days, __ATOMIC_RELEASE);
+        __atomic_store_n(&stock -> closes, closes, __ATOMIC_RELEASE);
+        stock -> capacity = capacity;
+    }
+
+    stock -> days[slot] = day;
+    stock -> closes[slot] = close;
+
+    extendCalendar(stock, day, row);
+
+    __atomic_store_n(&stock -> size, row + 1, __ATOMIC_RELEASE);
+}
+
+// Points the calendar's entry for day at row, growing it the same way appendRow() grows the columns
+void extendCalendar(Stock* stock, int day, int row)
+{
+    Calendar* calendar = stock -> calendar;
+
+    // A stock that started out empty gets a plain calendar beginning at its first bar
+    if (calendar == NULL)
+    {
+        calendar = calloc(1, sizeof(Calendar));
+        calendar->first_day = day;
+        __atomic_store_n(&stock -> calendar, calendar, __ATOMIC_RELEASE);
+    }
+
+    int offset = day - calendar->first_day;
+    bool compact = calendar->bits != NULL;
+
+    if (offset >= calendar->capacity)
+    {
+        int capacity = calendar->capacity * 2 > offset + 1 ? calendar->capacity * 2 : offset + 1;
+
+        if (!compact)
+        {
+            int* rows = malloc(capacity * sizeof(int));
+            if (calendar->length > 0)
+                memcpy(rows, calendar->rows, calendar->length * sizeof(int));
+
+            __atomic_store_n(&calendar->rows, rows, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            int words = (capacity + 63) / 64;
+            int used = (calendar->length + 63) / 64;
+            uint64_t* bits = calloc(words, sizeof(uint64_t));
+            uint32_t* ranks = calloc(words, sizeof(uint32_t));
+
+            memcpy(bits, calendar->bits, used * sizeof(uint64_t));
+            memcpy(ranks, calendar->ranks, used * sizeof(uint32_t));
+
+            __atomic_store_n(&calendar->bits, bits, __ATOMIC_RELEASE);
+            __atomic_store_n(&calendar->ranks, ranks, __ATOMIC_RELEASE);
+            capacity = words * 64;
+        }
+
+        calendar->capacity = capacity;
+    }
+
+    if (!compact)
+    {
+        // Nothing traded in the gap since the last bar
+        for (int i = calendar->length; i < offset; i++)
+            calendar->rows[i] = -1;
+
+        calendar->rows[offset] = row;
+    }
+    else
+    {
+        // Words past the old end are still empty, their ranks carry on from the last word in use
+        int used = (calendar->length + 63) / 64;
+        for (int w = used > 0 ? used : 1; w <= offset / 64; w++)
+            calendar->ranks[w] = calendar->ranks[w - 1] + __builtin_popcountll(calendar->bits[w - 1]);
+
+        uint64_t* word = &calendar->bits[offset / 64];
+        __atomic_store_n(word, *word | 1ULL << (offset % 64), __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&calendar->length, offset + 1, __ATOMIC_RELEASE);
+}
+
+// Applies every Append in the log on top of the csv files. Bars the csv files already have come out as out of
+// order and are skipped, just like they would be over the socket.
+void replayAppendLog(char* path, StockList* stocks)
+{
+    FILE* file = fopen(path, "r");
+
+    // Nothing has been appended yet
+    if (file == NULL)
+        return;
+
+    char line[1024];
+    int replayed = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        char** args = split(line);
+
+        if (args[0] != NULL && strcmp(args[0], "Append") == 0 && args[1] != NULL && strcmp(appendBars(stocks, args, NULL), "OK") == 0)
+            replayed++;
+
+        for (int i = 0; args[i] != NULL; i++)
+            free(args[i]);
+        free(args);
+    }
+
+    printf("Replayed %d appends from %s\n", replayed, path);
+    fclose(file);
+}
+
+// Subscribe TICKER [TICKER ...] keeps the connection open and pushes a line of "TICKER date close maxprofit" for
+// every new bar, where maxprofit is the best single trade from the ticker's first day up to that bar. The latest
+// bar of each ticker is sent straight away. The connection is handed to the hub thread through a copy of its
+// descriptor, so the empty response we give back lets the server close its own end like after any request.
+char* subscribeClient(StockList* stocks, char** args)
+{
+    if (c_socket < 0)
+        return "Subscribe needs a socket connection";
+
+    int count = 0;
+    while (args[1 + count] != NULL)
+        count++;
+
+    Subscription* subscriptions = malloc(count * sizeof(Subscription));
+
+    for (int i = 0; i < count; i++)
+    {
+        Stock* stock = findStock(stocks, args[1 + i]);
+        if (stock == NULL)
+        {
+            free(subscriptions);
+            return "Unknown";
+        }
+
+        // Everything but the latest bar is history, fold it in now so only that one goes out
+        int size = __atomic_load_n(&stock -> size, __ATOMIC_ACQUIRE);
+        Subscription* subscription = &subscriptions[i];
+        subscription->stock = stock;
+        subscription->next_row = size > 0 ? size - 1 : 0;
+        subscription->min_close = INFINITY;
+        subscription->max_profit = 0;
+
+        if (size > 1)
+        {
+            bool owned;
+            double* closes = getCloses(stock, 0, size - 2, &owned);
+
+            for (int row = 0; row < size - 1; row++)
+            {
+                if (closes[row] - subscription->min_close > subscription->max_profit)
+                    subscription->max_profit = closes[row] - subscription->min_close;
+
+                if (closes[row] < subscription->min_close)
+                    subscription->min_close = closes[row];
+            }
+
+            if (owned)
+                free(closes);
+        }
+    }
+
+    int fd = dup(c_socket);
+    if (fd < 0)
+    {
+        perror("Error: Unable to hand connection to subscriptions");
+        free(subscriptions);
+        return "Unable to subscribe";
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Left alone the kernel would happily queue megabytes for every subscriber that stops reading
+    int socketBuffer = SUBSCRIBER_SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &socketBuffer, sizeof(socketBuffer));
+
+    Subscriber* subscriber = malloc(sizeof(Subscriber));
+    subscriber->fd = fd;
+    subscriber->subscriptions = subscriptions;
+    subscriber->subscription_count = count;
+    subscriber->buffered = 0;
+
+    pthread_once(&hub_started, startSubscriptionHub);
+
+    pthread_mutex_lock(&hub_lock);
+    subscriber->next = hub_joining;
+    hub_joining = subscriber;
+    pthread_mutex_unlock(&hub_lock);
+
+    __atomic_store_n(&hub_signaled, true, __ATOMIC_RELEASE);
+    if (write(hub_wakeup[1], "s", 1) < 0 && errno != EAGAIN)
+        perror("Error: Unable to wake subscriptions");
+
+    return "";
+}
+
+void startSubscriptionHub()
+{
+    if (pipe(hub_wakeup) < 0)
+    {
+        perror("Error: Unable to create subscription pipe");
+        exit(1);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(hub_wakeup[i], F_SETFL, fcntl(hub_wakeup[i], F_GETFL) | O_NONBLOCK);
+        fcntl(hub_wakeup[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    // A subscriber hanging up halfway through a push shouldn't take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runSubscriptionHub, NULL) != 0)
+    {
+        perror("Error: Unable to start subscription thread");
+        exit(1);
+    }
+
+    pthread_detach(thread);
+}
+
+// Called after every successful Append, costs nothing until somebody subscribes
+void notifySubscribers()
+{
+    if (hub_wakeup[1] < 0 || __atomic_exchange_n(&hub_signaled, true, __ATOMIC_ACQ_REL))
+        return;
+
+    if (write(hub_wakeup[1], "a", 1) < 0 && errno != EAGAIN)
+        perror("Error: Unable to wake subscriptions");
+}
+
+void* runSubscriptionHub(void* arg)
+{
+    Subscriber** subscribers = NULL;
+    struct pollfd* waiting = malloc(sizeof(struct pollfd));
+    int count = 0;
+
+    while (1)
+    {
+        // Only subscribers with something left to send care about the socket being writable. Reads are just there
+        // to notice the other end going away, subscribers have nothing more to say.
+        waiting[0].fd = hub_wakeup[0];
+        waiting[0].events = POLLIN;
+
+        for (int i = 0; i < count; i++)
+        {
+            waiting[i + 1].fd = subscribers[i]->fd;
+            waiting[i + 1].events = POLLIN | (subscribers[i]->buffered > 0 ? POLLOUT : 0);
+        }
+
+        int polled = count;
+        if (poll(waiting, polled + 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("Error: Unable to wait for subscribers");
+            exit(1);
+        }
+
+        if (waiting[0].revents & POLLIN)
+        {
+            // Cleared before looking at the stocks, so an append that comes in after we looked wakes us again
+            __atomic_store_n(&hub_signaled, false, __ATOMIC_RELEASE);
+
+            char drained[64];
+            while (read(hub_wakeup[0], drained, sizeof(drained)) > 0);
+
+            pthread_mutex_lock(&hub_lock);
+            while (hub_joining != NULL)
+            {
+                Subscriber* joining = hub_joining;
+                hub_joining = joining->next;
+
+                subscribers = realloc(subscribers, (count + 1) * sizeof(Subscriber*));
+                subscribers[count++] = joining;
+                logRecord(LOG_DEBUG, "subscriber joined");
+            }
+            pthread_mutex_unlock(&hub_lock);
+
+            waiting = realloc(waiting, (count + 1) * sizeof(struct pollfd));
+        }
+
+        int alive = 0;
+        for (int i = 0; i < count; i++)
+        {
+            Subscriber* subscriber = subscribers[i];
+            bool connected = true;
+
+            if (i < polled && waiting[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                char ignored[256];
+                ssize_t n = recv(subscriber->fd, ignored, sizeof(ignored), 0);
+                connected = n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+            }
+
+            // Keep going while the socket takes everything, otherwise what's left waits for it to become writable
+            bool pending = connected;
+            while (pending && connected)
+            {
+                pending = fillSubscriber(subscriber);
+                connected = flushSubscriber(subscriber);
+                pending = pending && subscriber->buffered == 0;
+            }
+
+            if (!connected)
+            {
+                logRecord(LOG_DEBUG, "subscriber left");
+                close(subscriber->fd);
+                free(subscriber->subscriptions);
+                free(subscriber);
+                continue;
+            }
+
+            subscribers[alive++] = subscriber;
+        }
+
+        count = alive;
+    }
+
+    return NULL;
 }
 
-char** split(char* inputStr)
+// Queues a line for every bar the subscriber hasn't seen yet, as far as the buffer allows. Bars a slow subscriber
+// has no room for are skipped (still counting towards the running max profit) so it always ends on the latest.
+// True if the buffer filled up before every bar was queued.
+bool fillSubscriber(Subscriber* subscriber)
 {
-    char** splitVals = NULL;
-    char* str = malloc(sizeof(char));
-    str[0] = '\0';
+    bool pending = false;
 
-    int count = 0, bigCount = 0;
-    
-    for (int i = 0; i < strlen(inputStr); i++)
+    for (int i = 0; i < subscriber->subscription_count; i++)
     {
-        if (inputStr[i] != ' ' && inputStr[i] != 9)
+        Subscription* subscription = &subscriber->subscriptions[i];
+        Stock* stock = subscription->stock;
+        int size = __atomic_load_n(&stock -> size, __ATOMIC_ACQUIRE);
+
+        while (subscription->next_row < size)
         {
-            count++;
-            str = realloc(str, (count + 1) * sizeof(char));
-            str[count - 1] = inputStr[i];
-            str[count] = '\0';
+            int row = subscription->next_row;
+            char line[128];
+            bool room = SUBSCRIBER_BUFFER - subscriber->buffered >= (int)sizeof(line);
+            bool skip = row < size - 1 && (size - row > SUBSCRIBER_BACKLOG || !room);
 
-            if (i == strlen(inputStr) - 1)
+            // The latest bar waits for the socket to drain rather than being dropped
+            if (!skip && !room)
             {
-                bigCount++;
-                splitVals = realloc(splitVals, bigCount * sizeof(char*));
-                splitVals[bigCount - 1] = str;
+                pending = true;
+                break;
             }
 
-            continue;
-        }
+            double close = closeAt(stock, row);
+            if (close - subscription->min_close > subscription->max_profit)
+                subscription->max_profit = close - subscription->min_close;
+            if (close < subscription->min_close)
+                subscription->min_close = close;
 
-        // We don't want empty strings to be part of our array of strings
-        if (strlen(str) == 0)
-            continue;
-        
-        bigCount++;
-        splitVals = realloc(splitVals, bigCount * sizeof(char*));
-        splitVals[bigCount - 1] = str;
+            subscription->next_row++;
 
-        str = malloc(sizeof(char));
-        str[0] = '\0';
-        
-        count = 0;
-    }
+            if (skip)
+                continue;
 
-    // Add a terminating NULL value to the end of the data structure to signify that the end has been reached
-    splitVals = realloc(splitVals, (bigCount + 1) * sizeof(char*));
-    splitVals[bigCount] = NULL;
+            char date[12];
+            formatDay(dayAt(stock, row), date);
 
-    return splitVals;
+            int length = snprintf(line, sizeof(line), "%s %s %.2f %.2f\n", getStockName(stock), date, close, subscription->max_profit);
+            if (length > 0 && length < (int)sizeof(line))
+            {
+                memcpy(subscriber->buffer + subscriber->buffered, line, length);
+                subscriber->buffered += length;
+            }
+        }
+    }
+
+    return pending;
 }
 
-Stock* read_stock_data(char* filename) 
+// Sends as much of the buffer as the socket takes without blocking. False once the subscriber is gone.
+bool flushSubscriber(Subscriber* subscriber)
 {
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) 
+    while (subscriber->buffered > 0)
     {
-        printf("Could not open file %s\n", filename);
-        return NULL;
+        ssize_t sent = send(subscriber->fd, subscriber->buffer, subscriber->buffered, MSG_DONTWAIT);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        memmove(subscriber->buffer, subscriber->buffer + sent, subscriber->buffered - sent);
+        subscriber->buffered -= sent;
     }
 
-    char line[1024];
-    char* dates[1000];
-    char* prices[1000];
-    int count = 0;
+    return true;
+}
 
-    while (fgets(line, 1024, file)) 
+bool parseLogLevel(char* arg, LogLevel* level)
+{
+    char* names[] = {"error", "warn", "info", "debug"};
+
+    for (int i = 0; i < 4; i++)
     {
-        char* tmp = strdup(line);
-        char* tok;
-        int i = 0;
-        for (tok = strtok(line, ","); tok && *tok; tok = strtok(NULL, ",\n")) 
+        if (strcmp(arg, names[i]) == 0)
         {
-            if (i == 0) 
-                dates[count] = strdup(tok);
-            else if (i == 4) 
-                prices[count] = strdup(tok);
-            i++;
+            *level = (LogLevel)i;
+            return true;
         }
-        count++;
-        free(tmp);
     }
 
-    dates[count] = NULL;
-    prices[count] = NULL;
-
-    Stock* stock = malloc(sizeof(Stock));
-    stock->dates = dates;
-    stock->prices = prices;
-    stock->name = get_csv_stock_name(filename);
-
-    fclose(file);
-    return stock;
+    return false;
 }
 
-int endsWith(const char *str, const char *suffix) 
+// Queues one line for the log thread. Never blocks, a full ring just means the record is counted as dropped.
+void logRecord(LogLevel level, const char* text)
 {
-    if (!str || !suffix)
-        return 0;
-
-    size_t lenstr = strlen(str);
-    size_t lensuffix = strlen(suffix);
+    if (level > log_level)
+        return;
 
-    if (lensuffix > lenstr)
-        return 0;
+    // The first record from a thread sets up its ring, after that no locks are involved
+    if (log_ring == NULL)
+    {
+        pthread_once(&log_started, startLogger);
 
-    return strncmp(str + lenstr - lensuffix, suffix, lensuffix) == 0;
-}
+        log_ring = calloc(1, sizeof(LogRing));
+        pthread_setspecific(log_ring_key, log_ring);
 
-StockList* init_stock_list() 
-{
-    StockList* stock_list = malloc(sizeof(StockList));
-    stock_list->stocks = malloc(sizeof(Stock*));
-    stock_list->size = 0;
-    return stock_list;
-}
+        pthread_mutex_lock(&log_lock);
+        log_ring->thread_id = ++log_threads;
+        log_ring->next = log_rings;
+        __atomic_store_n(&log_rings, log_ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&log_lock);
+    }
 
-void append_stock(StockList* stock_list, Stock* stock) 
-{
-    stock_list->stocks = realloc(stock_list->stocks, (stock_list->size + 2) * sizeof(Stock*));
-    stock_list->stocks[stock_list->size] = stock;
-    stock_list->stocks[stock_list->size + 1] = NULL;
-    stock_list->size++;
-}
+    uint64_t head = log_ring->head;
+    if (head - __atomic_load_n(&log_ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+    {
+        __atomic_store_n(&log_ring->dropped, log_ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
 
-char* get_csv_stock_name(const char *filename) 
-{
-    const char *dot = strrchr(filename, '.');
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    if (!dot || dot == filename) 
-        return "";
+    LogRecord* record = &log_ring->records[head % LOG_RING_SIZE];
+    record->time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->level = level;
+    record->length = strnlen(text, LOG_TEXT_SIZE);
+    memcpy(record->text, text, record->length);
 
-    return strndup(filename, dot - filename);
+    __atomic_store_n(&log_ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
-char* getStockName(Stock* stock)
+void logRequest(const char* command)
 {
-    return stock -> name;
+    if (log_level < LOG_INFO || log_requests++ % log_sample_every != 0)
+        return;
+
+    logRecord(LOG_INFO, command);
 }
 
-int getIndex(char** theList, char* val)
+void startLogger()
 {
-    int index = 0;
+    // Startup messages go through stdio while the log thread write()s straight to the same fd, so get them out
+    // first or the two tear into each other. Nothing printf()s once the server is up.
+    fflush(stdout);
 
-    if (theList == NULL)
-        return -1;
+    pthread_key_create(&log_ring_key, retireLogRing);
 
-    
-    while (theList[index] != NULL)
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runLogger, NULL) != 0)
     {
-        if (strcmp(theList[index], val) == 0)
-            return index;
-        
-        index++;
-
-        if (index > 1000)
-            return -1;
+        perror("Error: Unable to start log thread");
+        exit(1);
     }
 
-    return -1;
+    pthread_detach(thread);
+
+    // Whatever is still queued when we exit (quit, say) gets written out on the way
+    atexit(flushLogs);
 }
 
-char* roundUp(char* str) 
+void* runLogger(void* arg)
 {
-   float num = atof(str);
-   float rounded = (num * 100) / 100;
+    struct timespec idle = { 0, LOG_IDLE_SLEEP_NS };
 
-   char* result = malloc(10 * sizeof(char));
-   sprintf(result, "%.2f", rounded);
+    while (1)
+    {
+        pthread_mutex_lock(&log_drain_lock);
+        int written = drainLogs();
+        pthread_mutex_unlock(&log_drain_lock);
 
-   return result;
+        if (written == 0)
+            nanosleep(&idle, NULL);
+    }
+
+    return NULL;
 }
 
-char** getDates(char* start, char* end, char* filename)
+// Writes out everything queued so far as logfmt lines and returns how many records that was. Only one caller at a
+// time (log_drain_lock) since it is the consumer side of every ring.
+int drainLogs()
 {
-    char** dates = malloc(305 * sizeof(char*));
-
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) 
-    {
-        printf("Could not open file %s\n", filename);
-        exit(1);
-    }
+    char* levels[] = {"error", "warn", "info", "debug"};
+    char out[65536];
+    int used = 0;
+    int written = 0;
 
-    char line[1024];
-    int count = 0;
-    char* t = malloc(12 * sizeof(char));
+    LogRing* previous = NULL;
+    LogRing* ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
 
-    while (fgets(line, 1024, file)) 
+    while (ring != NULL)
     {
-        char* tmp = strdup(line);
-        char* tok;
-        int i = 0;
-        for (tok = strtok(line, ","); tok && *tok; tok = strtok(NULL, ",\n")) 
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+        // One extra pass at the end to say how many records didn't fit since we last looked
+        for (uint64_t i = ring->tail; i < head || dropped > ring->reported; i++)
         {
-            if (i == 0) 
+            // Room for the longest line, with every character of the text escaped
+            if (used > (int)sizeof(out) - 2 * LOG_TEXT_SIZE - 128)
             {
-                t = strdup(tok);
+                writeLogs(out, used);
+                used = 0;
+            }
 
-                // True if in the range
-                if (validDate(t) && !dateIsBefore(t, start) && !dateIsBefore(end, t))
-                {
-                    dates[count] = malloc(12 * sizeof(char));
-                    strcpy(dates[count], t);
-                    count++;
-                }   
+            LogRecord notice;
+            LogRecord* record = &ring->records[i % LOG_RING_SIZE];
+
+            if (i >= head)
+            {
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+
+                record = &notice;
+                record->time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+                record->level = LOG_WARN;
+                record->length = snprintf(record->text, LOG_TEXT_SIZE, "dropped %llu log records",
+                    (unsigned long long)(dropped - ring->reported));
+                ring->reported = dropped;
             }
 
-            i++;
-        }
-        free(tmp);
-        free(t);
-    }
+            time_t seconds = record->time / 1000000000ULL;
+            struct tm utc;
+            gmtime_r(&seconds, &utc);
 
-    dates[count] = NULL;
+            used += strftime(out + used, 32, "ts=%Y-%m-%dT%H:%M:%S", &utc);
+            used += sprintf(out + used, ".%06uZ level=%s thread=%d msg=\"", (unsigned)(record->time % 1000000000ULL / 1000),
+                levels[record->level], ring->thread_id);
 
-    return dates;
-}
+            for (int c = 0; c < record->length; c++)
+            {
+                char ch = record->text[c];
 
-char** getPrices(char* start, char* end, char* filename)
-{
-    char** prices = malloc(305 * sizeof(char*));
+                if (ch == '"' || ch == '\\')
+                    out[used++] = '\\';
 
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) 
-    {
-        printf("Could not open file %s\n", filename);
-        exit(1);
-    }
+                if (ch == '\n' || ch == '\r' || ch == '\t')
+                {
+                    out[used++] = '\\';
+                    ch = ch == '\n' ? 'n' : ch == '\r' ? 'r' : 't';
+                }
 
-    char line[1024];
-    int count = 0;
-    char* t = malloc(20 * sizeof(char));
-    bool inRange = false;
+                out[used++] = (unsigned char)ch < ' ' ? '?' : ch;
+            }
+            used += sprintf(out + used, "\"\n");
 
+            if (i < head)
+                __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
 
-    while (fgets(line, 1024, file)) 
-    {
-        char* tmp = strdup(line);
-        char* tok;
-        int i = 0;
-        for (tok = strtok(line, ","); tok && *tok; tok = strtok(NULL, ",\n")) 
-        {
-            if (i == 0) 
-            {
-                inRange = false;
+            written++;
+        }
 
-                t = strdup(tok);
+        LogRing* next = ring->next;
 
-                // True if in the range
-                if (validDate(t) && !dateIsBefore(t, start) && !dateIsBefore(end, t))
-                {
-                    inRange = true;
-                }   
-            }
-            else if (i == 4)
+        // Rings of threads that have finished (shared memory sessions) go away once they are empty
+        if (__atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE) && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&log_lock);
+
+            // Other threads may have put their rings in front of it since we started
+            if (previous == NULL && log_rings != ring)
             {
-                if (inRange)
-                {
-                    t = strdup(tok);
-                    prices[count] = malloc(20 * sizeof(char));
-                    strcpy(prices[count], t);
-                    count++;
-                }
+                previous = log_rings;
+                while (previous->next != ring)
+                    previous = previous->next;
             }
 
-            i++;
+            if (previous == NULL)
+                __atomic_store_n(&log_rings, next, __ATOMIC_RELEASE);
+            else
+                previous->next = next;
+
+            pthread_mutex_unlock(&log_lock);
+            free(ring);
         }
-        free(tmp);
-        free(t);
+        else
+            previous = ring;
+
+        ring = next;
     }
 
-    prices[count] = NULL;
+    writeLogs(out, used);
 
-    return prices;
+    return written;
 }
 
-bool dateIsBefore(char* date1, char* date2) 
+// Only the log thread ever waits on this, so a log that can't keep up just means full rings and dropped records
+void writeLogs(char* data, int length)
 {
-    int year1, month1, day1;
-    int year2, month2, day2;
+    int done = 0;
 
-    if (sscanf(date1, "%d-%d-%d", &year1, &month1, &day1) != 3 ||
-        sscanf(date2, "%d-%d-%d", &year2, &month2, &day2) != 3) 
+    while (done < length)
     {
-        return false;
-    }
+        int n = write(log_fd, data + done, length - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
 
-    if (year1 < year2) 
-        return true;
-    else if (year1 > year2) 
-        return false;
+            perror("Error: Unable to write log");
+            return;
+        }
 
-    if (month1 < month2) 
-        return true;
-    else if (month1 > month2) 
-        return false;
+        done += n;
+    }
+}
 
-    if (day1 < day2) 
-        return true;
+void flushLogs()
+{
+    pthread_mutex_lock(&log_drain_lock);
+    drainLogs();
+    pthread_mutex_unlock(&log_drain_lock);
+}
 
-    return false;
+// Thread exit hook for the ring's owner, the log thread frees it after writing out what's left
+void retireLogRing(void* ring)
+{
+    __atomic_store_n(&((LogRing*)ring)->retired, true, __ATOMIC_RELEASE);
 }
 
-bool validDate(char* date) 
+#ifdef TRACE
+
+#define TRACE_RING_SIZE 65536
+
+typedef struct
 {
-    int year, month, day;
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+} TraceEvent;
 
-    if (sscanf(date, "%d-%d-%d", &year, &month, &day) != 3) 
-        return false;
+// Only the owning thread writes to a buffer, once full the oldest events get overwritten
+typedef struct TraceBuffer
+{
+    TraceEvent events[TRACE_RING_SIZE];
+    uint64_t count;
+    int thread_id;
+    struct TraceBuffer* next;
+} TraceBuffer;
 
-    if (year < 1800 || year > 9999) 
-        return false;
-    
-    if (month < 1 || month > 12) 
-        return false;
+TraceBuffer* trace_buffers = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+int trace_threads = 0;
 
-    if (day < 1 || day > 31) 
-        return false;
+__thread TraceBuffer* trace_buffer = NULL;
+__thread unsigned trace_requests = 0;
+__thread bool trace_sampled = true;
 
-    // February
-    if (month == 2) 
-    {
-        if (year % 400 == 0 || (year % 100 != 0 && year % 4 == 0)) 
-        {
-            if (day > 29) 
-            {
-                return false;
-            }
-        } 
-        else 
-        {
-            if (day > 28) 
-            {
-                return false;
-            }
-        }
-    } 
-    else if (month == 4 || month == 6 || month == 9 || month == 11) 
-    {
-        if (day > 30) 
-        {
-            return false;
-        }
-    }
+uint64_t traceNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    return true;
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
-float calculateMaxProfit(char** prices) 
+// Called once per request to decide whether its spans get recorded
+void traceRequest()
 {
-    int size = 0;
-    
-    while (prices[size] != NULL)
-        size++;
-    
-    // Should never occur but here just in case since I don't want to risk a seg fault
-    if (size < 2)
-        return 0;
-    
-    float minPrice = (float)atof(prices[0]);
-    float maxProfit = (float)atof(prices[1]) - (float)atof(prices[0]);
+    trace_sampled = trace_requests++ % trace_sample_every == 0;
+}
 
-    for (int i = 1; i < size; i++) 
+TraceSpan traceBegin(const char* name)
+{
+    TraceSpan span = { name, 0, trace_sampled };
+
+    if (span.open)
     {
-        float currentPrice = (float)atof(prices[i]);
+        TRACE_PROBE(stage_begin, name);
+        span.start = traceNow();
+    }
 
-        // Calculate profit if we bought at min price and sold at current price
-        float potentialProfit = currentPrice - minPrice;
+    return span;
+}
 
-        if (potentialProfit > maxProfit)
-            maxProfit = potentialProfit;
+void traceEnd(TraceSpan* span)
+{
+    if (!span->open)
+        return;
 
-        if (currentPrice < minPrice)
-            minPrice = currentPrice;
+    span->open = false;
+    uint64_t end = traceNow();
+    TRACE_PROBE(stage_end, span->name);
+
+    if (trace_buffer == NULL)
+    {
+        trace_buffer = calloc(1, sizeof(TraceBuffer));
+
+        pthread_mutex_lock(&trace_lock);
+        trace_buffer->thread_id = ++trace_threads;
+        trace_buffer->next = trace_buffers;
+        trace_buffers = trace_buffer;
+        pthread_mutex_unlock(&trace_lock);
     }
 
-    if (maxProfit < 0)
-        maxProfit = 0;
+    uint64_t count = trace_buffer->count;
+    TraceEvent* event = &trace_buffer->events[count % TRACE_RING_SIZE];
+    event->name = span->name;
+    event->start = span->start;
+    event->end = end;
 
-    return maxProfit;
+    __atomic_store_n(&trace_buffer->count, count + 1, __ATOMIC_RELEASE);
 }
 
-bool validBorderDates(char** dates, char* start, char* end)
+void traceFlush()
 {
-    int size = 0;
-    while (dates[size] != NULL)
-        size++;
-    
-    if (size < 2 || strcmp(dates[0], start) != 0 || strcmp(dates[size - 1], end) != 0)
-        return false;
-    
-    return true;
+    FILE* file = fopen(trace_path, "w");
+    if (file == NULL)
+    {
+        perror("Error: Unable to write trace");
+        return;
+    }
+
+    fprintf(file, "{\"traceEvents\":[");
+
+    bool first = true;
+    pthread_mutex_lock(&trace_lock);
+
+    for (TraceBuffer* buffer = trace_buffers; buffer != NULL; buffer = buffer->next)
+    {
+        uint64_t count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        uint64_t oldest = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+
+        for (uint64_t i = oldest; i < count; i++)
+        {
+            TraceEvent* event = &buffer->events[i % TRACE_RING_SIZE];
+
+            // Chrome wants microseconds
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                first ? "" : ",", event->name, event->start / 1000.0, (event->end - event->start) / 1000.0,
+                (int)getpid(), buffer->thread_id);
+            first = false;
+        }
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
 }
 
+#endif